@@ -4,7 +4,7 @@ set -e
 
 USAGE="usage: $0 [-qvgrb -ttarget]"
 
-CFLAGS="$CFLAGS -D_GREEN_EXPORT_INTERNALS"
+CFLAGS="$CFLAGS -pthread -D_GREEN_EXPORT_INTERNALS"
 CC=gcc
 build=false
 run=false
@@ -78,12 +78,22 @@ if ! $build && ! $run; then
     run=true
 fi
 
+# green.hpp is tested from its own translation unit, built as C++20
+CXX="${CC%gcc}g++"
+
 if $build && ! command -v "$CC" >/dev/null; then
     echo "$CC not installed"
     exit 2
 fi
 
-SOURCES="test-green.c green.c"
+if $build && ! command -v "$CXX" >/dev/null; then
+    echo "$CXX not installed"
+    exit 2
+fi
+
+SOURCES="test-green.c green.c green_interpose.c"
+CXXSOURCES="test-green-hpp.cpp"
+CFLAGS+=" -Wl,--wrap=read,--wrap=write,--wrap=connect,--wrap=poll,--wrap=nanosleep"
 
 if $add_asm; then
     SOURCES+=" green.$mname.s"
@@ -91,12 +101,16 @@ fi
 
 if $build; then
     if [ $vn -eq 1 ]; then
+        echo "c++ $CXXSOURCES"
         echo "cc $SOURCES"
     elif [ $vn -ge 2 ]; then
-        echo "$CC -o $oname $CFLAGS $SOURCES"
+        echo "$CXX -c -o $oname-hpp.o -std=c++20 $CFLAGS $CXXSOURCES"
+        echo "$CC -o $oname $CFLAGS $SOURCES $oname-hpp.o -lstdc++"
     fi
 
-    "$CC" -o $oname $CFLAGS $SOURCES
+    "$CXX" -c -o $oname-hpp.o -std=c++20 $CFLAGS $CXXSOURCES
+    "$CC" -o $oname $CFLAGS $SOURCES $oname-hpp.o -lstdc++
+    rm -f $oname-hpp.o
 fi
 
 if $run; then
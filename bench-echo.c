@@ -0,0 +1,639 @@
+/* This file is part of https://github.com/NelsonCrosby/green.c */
+/* BSD 2-Clause License                                                      *
+ *                                                                           *
+ * Copyright (c) 2020, Nelson Crosby <nelson@tika.to>                        *
+ * All rights reserved.                                                      *
+ *                                                                           *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Loopback echo benchmark.
+ *
+ * Forks an echo server, then drives it from this process
+ * with one closed-loop client per connection
+ * (send a request, wait for all of it to come back, repeat),
+ * all over 127.0.0.1.
+ * The same load generator runs against three servers:
+ *
+ *  green    one coroutine per connection on a green_sched,
+ *           waiting for I/O through a green_poll hook backed by epoll;
+ *  threads  one pthread per connection, blocking in read and write;
+ *  epoll    one pthread calling back per connection from epoll_wait.
+ *
+ * Each run reports requests per second, latency percentiles,
+ * and the server's peak RSS and context switches (from wait4).
+ *
+ * Build and run with something like:
+ *
+ *  gcc -O2 -pthread -o bench-echo bench-echo.c green.c
+ *  ./bench-echo -c 1000,10000,100000
+ *
+ * 100K connections need `ulimit -n` of a little over 200K
+ * (the client and server share the machine's descriptors).
+ * Connections are spread over source addresses 127.0.0.2 and up,
+ * so they are not limited by a single address's ephemeral ports.
+ */
+
+#define _GNU_SOURCE
+
+#include "green.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+
+#define MAX_REQUEST     65536
+#define ECHO_BUFFER     4096        // servers echo in chunks of this
+#define MAX_EVENTS      1024
+#define SOURCE_ADDRS    250
+#define HIST_US         1000000     // latencies past 1s share a bucket
+#define THREAD_STACK    65536
+#define GREEN_STACK     16384
+
+static const char *const modes[] = { "green", "threads", "epoll" };
+
+static size_t request_size = 64;
+
+
+static void fail(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void set_nonblocking(int fd)
+{
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0)
+        fail("fcntl");
+}
+
+static void set_nodelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static int listen_loopback(unsigned short *port)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t len = sizeof(addr);
+    int fd, one = 1;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        fail("socket");
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(fd, SOMAXCONN) != 0
+        || getsockname(fd, (struct sockaddr *)&addr, &len) != 0)
+        fail("listen");
+
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+
+/*
+ * green: the scheduler runs ready coroutines,
+ * then waits in epoll_wait for the ones parked in green_poll.
+ * Each connection's descriptor is registered once, edge-triggered,
+ * and its coroutine is made ready whenever it is waiting for that event.
+ */
+struct green_conn {
+    int fd;
+    uint32_t waiting;
+    green_thread_t thread;
+};
+
+static struct green_sched green_server;
+static int green_epoll;
+static int green_conn_key;
+
+static int green_epoll_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    struct green_conn *conn = green_local_get(green_conn_key);
+
+    // Only the single-descriptor, wait-forever case comes up here
+    if (nfds != 1 || timeout >= 0 || conn == NULL || conn->fd != fds[0].fd)
+        return poll(fds, nfds, timeout);
+
+    conn->waiting = (fds[0].events & POLLIN ? EPOLLIN : 0)
+                  | (fds[0].events & POLLOUT ? EPOLLOUT : 0);
+    fds[0].revents = (short)(uintptr_t)green_await(GREEN_SCHED_PARK);
+    return 1;
+}
+
+static void green_echo(void *arguments)
+{
+    struct green_conn *conn = arguments;
+    struct pollfd pfd = { conn->fd, POLLIN, 0 };
+    char buffer[ECHO_BUFFER];
+    ssize_t n, sent, m;
+
+    green_local_set(green_conn_key, conn);
+    for (;;) {
+        n = read(conn->fd, buffer, sizeof(buffer));
+        if (n == 0 || (n < 0 && errno != EAGAIN))
+            break;
+        if (n < 0) {
+            pfd.events = POLLIN;
+            green_poll(&pfd, 1, -1);
+            continue;
+        }
+
+        for (sent = 0; sent < n; sent += m) {
+            m = write(conn->fd, buffer + sent, n - sent);
+            if (m < 0 && errno != EAGAIN)
+                goto done;
+            if (m < 0) {
+                m = 0;
+                pfd.events = POLLOUT;
+                green_poll(&pfd, 1, -1);
+            }
+        }
+    }
+
+done:
+    close(conn->fd);
+    free(conn);
+}
+
+static void green_serve(int listener)
+{
+    struct epoll_event events[MAX_EVENTS], event;
+    struct green_conn *conn;
+    int fd, n, i;
+
+    green_sched_init(&green_server);
+    green_set_poll(green_epoll_poll);
+    green_conn_key = green_local_key();
+    if ((green_epoll = epoll_create1(0)) < 0)
+        fail("epoll_create1");
+
+    set_nonblocking(listener);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(green_epoll, EPOLL_CTL_ADD, listener, &event);
+
+    for (;;) {
+        green_sched_run(&green_server);
+        n = epoll_wait(green_epoll, events, MAX_EVENTS, -1);
+
+        for (i = 0; i < n; i += 1) {
+            if ((conn = events[i].data.ptr) != NULL) {
+                if (conn->waiting & events[i].events) {
+                    conn->waiting = 0;
+                    green_sched_ready(&green_server, conn->thread,
+                        (green_resume_t)(uintptr_t)events[i].events);
+                }
+                continue;
+            }
+
+            while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                set_nodelay(fd);
+                conn = malloc(sizeof(*conn));
+                conn->fd = fd;
+                conn->waiting = 0;
+                conn->thread = green_spawn(green_echo, conn, GREEN_STACK);
+                if (conn->thread == NULL) {
+                    close(fd);
+                    free(conn);
+                    continue;
+                }
+
+                event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+                event.data.ptr = conn;
+                epoll_ctl(green_epoll, EPOLL_CTL_ADD, fd, &event);
+                green_sched_ready(&green_server, conn->thread, NULL);
+            }
+        }
+    }
+}
+
+
+// threads: one blocking pthread per connection
+static void *thread_echo(void *arguments)
+{
+    int fd = (int)(intptr_t)arguments;
+    char buffer[ECHO_BUFFER];
+    ssize_t n, sent, m;
+
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (sent = 0; sent < n; sent += m) {
+            if ((m = write(fd, buffer + sent, n - sent)) < 0)
+                goto done;
+        }
+    }
+
+done:
+    close(fd);
+    return NULL;
+}
+
+static void thread_serve(int listener)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int fd;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (;;) {
+        if ((fd = accept(listener, NULL, NULL)) < 0)
+            continue;
+        set_nodelay(fd);
+        if (pthread_create(&thread, &attr, thread_echo, (void *)(intptr_t)fd) != 0)
+            close(fd);
+    }
+}
+
+
+// epoll: a callback per readable connection, buffering what could not be sent
+struct epoll_conn {
+    int fd;
+    size_t pending, offset;
+    char buffer[ECHO_BUFFER];
+};
+
+static void epoll_close(struct epoll_conn *conn)
+{
+    close(conn->fd);
+    free(conn);
+}
+
+static void epoll_on_ready(int epfd, struct epoll_conn *conn)
+{
+    struct epoll_event event = { .data.ptr = conn };
+    ssize_t n;
+
+    for (;;) {
+        while (conn->pending > 0) {
+            n = write(conn->fd, conn->buffer + conn->offset, conn->pending);
+            if (n < 0) {
+                if (errno != EAGAIN)
+                    return epoll_close(conn);
+                event.events = EPOLLOUT;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &event);
+                return;
+            }
+            conn->offset += n;
+            conn->pending -= n;
+        }
+
+        n = read(conn->fd, conn->buffer, sizeof(conn->buffer));
+        if (n == 0 || (n < 0 && errno != EAGAIN))
+            return epoll_close(conn);
+        if (n < 0) {
+            event.events = EPOLLIN;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &event);
+            return;
+        }
+        conn->offset = 0;
+        conn->pending = n;
+    }
+}
+
+static void epoll_serve(int listener)
+{
+    struct epoll_event events[MAX_EVENTS], event;
+    struct epoll_conn *conn;
+    int epfd, fd, n, i;
+
+    if ((epfd = epoll_create1(0)) < 0)
+        fail("epoll_create1");
+
+    set_nonblocking(listener);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &event);
+
+    for (;;) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        for (i = 0; i < n; i += 1) {
+            if ((conn = events[i].data.ptr) != NULL) {
+                epoll_on_ready(epfd, conn);
+                continue;
+            }
+
+            while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                set_nodelay(fd);
+                conn = malloc(sizeof(*conn));
+                conn->fd = fd;
+                conn->pending = 0;
+                event.events = EPOLLIN;
+                event.data.ptr = conn;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+            }
+        }
+    }
+}
+
+
+/*
+ * The load generator: every connection keeps exactly one request
+ * in flight, and its latency is measured from the first byte sent
+ * to the last byte echoed back.
+ */
+struct client {
+    int fd;
+    size_t sent, received;
+    unsigned long long started;
+};
+
+struct results {
+    unsigned long long requests;
+    unsigned long long errors;
+    double seconds;
+    unsigned long p50, p99, p999;  // microseconds
+    long rss_kb;
+    long switches;
+};
+
+static unsigned *histogram;
+
+static int client_send(struct client *client, const char *request)
+{
+    ssize_t n;
+
+    while (client->sent < request_size) {
+        n = write(client->fd, request + client->sent, request_size - client->sent);
+        if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+        client->sent += n;
+    }
+
+    return 0;
+}
+
+static int client_connect(struct client *client, unsigned short port, size_t i)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+
+    if ((client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+        return -1;
+    set_nodelay(client->fd);
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + i % SOURCE_ADDRS);
+    if (bind(client->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        return -1;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        && errno != EINPROGRESS)
+        return -1;
+
+    return 0;
+}
+
+static unsigned long percentile(unsigned long long total, double fraction)
+{
+    unsigned long long want = (unsigned long long)(total * fraction), seen = 0;
+    unsigned long us;
+
+    for (us = 0; us < HIST_US; us += 1) {
+        seen += histogram[us];
+        if (seen > want)
+            return us;
+    }
+
+    return HIST_US;
+}
+
+static void drive(
+    unsigned short port, size_t n_conns, double seconds, struct results *results
+) {
+    struct epoll_event *events = calloc(MAX_EVENTS, sizeof(*events)), event;
+    struct client *clients = calloc(n_conns, sizeof(*clients)), *client;
+    char request[MAX_REQUEST], reply[MAX_REQUEST];
+    unsigned long long start, end, now, latency;
+    size_t i, connected = 0;
+    int epfd, n, j;
+    ssize_t got;
+
+    memset(request, 'x', request_size);
+    memset(histogram, 0, (HIST_US + 1) * sizeof(*histogram));
+    if ((epfd = epoll_create1(0)) < 0)
+        fail("epoll_create1");
+
+    // Connect everything before the clock starts
+    for (i = 0; i < n_conns; i += 1) {
+        if (client_connect(&clients[i], port, i) != 0)
+            fail("connect");
+        event.events = EPOLLOUT | EPOLLONESHOT;
+        event.data.ptr = &clients[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &event);
+    }
+    while (connected < n_conns) {
+        if ((n = epoll_wait(epfd, events, MAX_EVENTS, 10000)) <= 0) {
+            fprintf(stderr, "only %zu of %zu connections were made\n",
+                    connected, n_conns);
+            exit(1);
+        }
+        connected += n;
+    }
+
+    start = now_ns();
+    end = start + (unsigned long long)(seconds * 1e9);
+    for (i = 0; i < n_conns; i += 1) {
+        client = &clients[i];
+        client->started = start;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.ptr = client;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &event);
+        if (client_send(client, request) != 0)
+            results->errors += 1;
+    }
+
+    while ((now = now_ns()) < end) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (j = 0; j < n; j += 1) {
+            client = events[j].data.ptr;
+            if (events[j].events & (EPOLLERR | EPOLLHUP)) {
+                results->errors += 1;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+                continue;
+            }
+            if (client_send(client, request) != 0)
+                results->errors += 1;
+
+            while ((got = read(client->fd, reply, sizeof(reply))) > 0) {
+                client->received += got;
+                if (client->received < request_size)
+                    continue;
+
+                latency = (now_ns() - client->started) / 1000;
+                histogram[latency < HIST_US ? latency : HIST_US] += 1;
+                results->requests += 1;
+
+                client->sent = client->received = 0;
+                client->started = now_ns();
+                if (client_send(client, request) != 0)
+                    results->errors += 1;
+            }
+        }
+    }
+
+    results->seconds = (now - start) / 1e9;
+    results->p50 = percentile(results->requests, 0.5);
+    results->p99 = percentile(results->requests, 0.99);
+    results->p999 = percentile(results->requests, 0.999);
+
+    for (i = 0; i < n_conns; i += 1)
+        close(clients[i].fd);
+    close(epfd);
+    free(clients);
+    free(events);
+}
+
+static void run(const char *mode, size_t n_conns, double seconds, struct results *results)
+{
+    struct rusage usage;
+    unsigned short port;
+    int listener, status;
+    pid_t server;
+
+    memset(results, 0, sizeof(*results));
+    listener = listen_loopback(&port);
+
+    if ((server = fork()) < 0)
+        fail("fork");
+    if (server == 0) {
+        if (strcmp(mode, "green") == 0)
+            green_serve(listener);
+        else if (strcmp(mode, "threads") == 0)
+            thread_serve(listener);
+        else
+            epoll_serve(listener);
+        _exit(0);
+    }
+
+    close(listener);
+    drive(port, n_conns, seconds, results);
+
+    kill(server, SIGKILL);
+    if (wait4(server, &status, 0, &usage) < 0)
+        fail("wait4");
+    results->rss_kb = usage.ru_maxrss;
+    results->switches = usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [-m mode[,mode...]] [-c conns[,conns...]] [-d seconds] [-s bytes]\n"
+        "  modes: green, threads, epoll (default: all three)\n"
+        "  default: -c 1000,10000,100000 -d 5 -s 64\n",
+        name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode_list = "green,threads,epoll", *conn_list = "1000,10000,100000";
+    char *modes_copy, *conns_copy, *mode, *conns, *save_mode, *save_conns;
+    struct results results;
+    double seconds = 5;
+    size_t n_conns;
+    int option;
+
+    while ((option = getopt(argc, argv, "m:c:d:s:h")) != -1) {
+        switch (option) {
+        case 'm':   mode_list = optarg; break;
+        case 'c':   conn_list = optarg; break;
+        case 'd':   seconds = atof(optarg); break;
+        case 's':   request_size = strtoul(optarg, NULL, 0); break;
+        default:    usage(argv[0]);
+        }
+    }
+    if (request_size == 0 || request_size > MAX_REQUEST || seconds <= 0)
+        usage(argv[0]);
+
+    raise_fd_limit();
+    signal(SIGPIPE, SIG_IGN);
+    if ((histogram = calloc(HIST_US + 1, sizeof(*histogram))) == NULL)
+        fail("calloc");
+
+    printf("%-8s %8s %12s %8s %8s %8s %10s %10s %8s\n",
+           "mode", "conns", "req/s", "p50 us", "p99 us", "p999 us",
+           "rss KB", "ctx sw", "errors");
+
+    conns_copy = strdup(conn_list);
+    for (conns = strtok_r(conns_copy, ",", &save_conns); conns != NULL;
+         conns = strtok_r(NULL, ",", &save_conns)) {
+        n_conns = strtoul(conns, NULL, 0);
+
+        modes_copy = strdup(mode_list);
+        for (mode = strtok_r(modes_copy, ",", &save_mode); mode != NULL;
+             mode = strtok_r(NULL, ",", &save_mode)) {
+            if (strcmp(mode, modes[0]) != 0 && strcmp(mode, modes[1]) != 0
+                && strcmp(mode, modes[2]) != 0)
+                usage(argv[0]);
+
+            run(mode, n_conns, seconds, &results);
+            printf("%-8s %8zu %12.0f %8lu %8lu %8lu %10ld %10ld %8llu\n",
+                   mode, n_conns, results.requests / results.seconds,
+                   results.p50, results.p99, results.p999,
+                   results.rss_kb, results.switches, results.errors);
+            fflush(stdout);
+        }
+        free(modes_copy);
+    }
+    free(conns_copy);
+
+    return 0;
+}
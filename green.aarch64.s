@@ -28,6 +28,9 @@
 
 	.text
 
+	# Size of struct _green_ext (see green.c), which sits below the header
+	.set	_GREEN_EXT_SIZE, 224
+
 	.globl	green_spawn
 	.globl	green_resume
 	.globl	green_await
@@ -45,18 +48,12 @@ green_spawn:
 	csel	x1, x1, x2, ne
 	str	x1, [sp, #-16]!
 
-	# mmap(NULL, hint, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0)
-	mov	x0, #0
-	mov	w2, #0x03
-	mov	w3, #0x22
-	mov	w4, #-1
-	mov	x5, #0
-	bl	mmap
-
-	cmp	x0, #-1
-	bne	_alloc_ok
-	# mmap returned MAP_FAILED; gotta return NULL.
-	mov	x0, #0
+	# _green_stack_alloc(&length) (rounds length up to its size class)
+	mov	x0, sp
+	bl	_green_stack_alloc
+
+	cbnz	x0, _alloc_ok
+	# Allocation failed; gotta return NULL.
 	mov	sp, x29
 	ldp	x29, lr, [sp], #16
 	ret
@@ -75,19 +72,20 @@ _alloc_ok:
 	#   void (*start)(void *arguments);                 // 16
 	#   void *arguments;                                // 24
 	#   union { void *calling; void *resuming; } sp;    // 32
-	#   long padding;                                   // 40
+	#   struct green_cleanup *cleanup;                  // 40
 	# }                                            // size 48
+	# with struct _green_ext directly below it
 	stp	x0, x1, [x0, #0]
 	stp	x2, x3, [x0, #16]
 
         # Prepare stack for resume to return into _thread_call
-	mov	x4, x0
+	sub	x4, x0, #_GREEN_EXT_SIZE
 	# fp, lr
 	mov	x1, x0
 	adr	x2, _thread_call
 	stp	x1, x2, [x4, #-16]!
 	# Allocate space for another 12(!) saved registers
-	sub	x4, x0, #96
+	sub	x4, x0, #(96 + _GREEN_EXT_SIZE)
 	# Save stack pointer
 	str	x4, [x0, #32]
 
@@ -97,33 +95,32 @@ _alloc_ok:
 
 _thread_call:
 	# thread->start(arguments)
-	ldp	x1, x0, [sp, #16]
+	# (found through the handle, since green_spawn_args
+	#  may have moved this frame down the stack)
+	bl	_green_current
+	ldr	x1, [x0]
+	ldp	x1, x0, [x1, #16]
 	blr	x1
 
 _thread_return:
 	bl	_green_current
-	# NOTE: *current should always be sp,
-	#       and the active flag should always be set,
-	#       because if a thread is returning it must be active...
-	#       right?
+	ldr	x2, [x0]
 
+_thread_finish:
 	# Restore last active thread
-	ldr	x1, [sp]
+	ldr	x1, [x2]
 	str	x1, [x0]
 
-	# Prepare munmap arguments
-	add	x0, sp, #48
-	ldr	x1, [sp, #8]
 	# Hop back to calling stack
-	ldr	x2, [sp, #32]
-	mov	sp, x2
+	ldr	x3, [x2, #32]
+	mov	sp, x3
 
-	# Resolve bottom of allocation and call munmap
-	sub	x0, x0, x1
-	bl	munmap
+	# _green_release(thread) runs cleanups and frees the stack
+	mov	x0, x2
+	bl	_green_release
 
-	# Restore saved registers and return
-	# (uses zero returned from munmap)
+	# Restore saved registers and return NULL
+	mov	x0, #0
         ldp	x19, x20, [sp], #16
         ldp	x21, x22, [sp], #16
         ldp	x23, x24, [sp], #16
@@ -139,8 +136,10 @@ green_resume:
 	mov	x29, sp
 
 	# Get thread-local current thread (green_thread_t *)
+	# and switch count (unsigned long *)
 	stp	x0, x1, [sp, #-16]!
-	bl	_green_current
+	bl	_green_resuming
+	mov	x6, x1
 	ldp	x2, x1, [sp], #16
 	ldr	x4, [x0]
 
@@ -158,6 +157,10 @@ _resume_activate_fail:
 	ret
 
 _resume_activate_ok:
+	# Count the switch for the watchdog
+	ldr	x5, [x6]
+	add	x5, x5, #1
+	str	x5, [x6]
 	# Set thread as current
 	str	x2, [x0]
 
@@ -215,6 +218,9 @@ green_await:
 	ret
 
 _await_ok:
+	# Awaiting NULL stops the thread early
+	cbz	x1, _thread_finish
+
 	# Save necessary registers
 	# fp, lr already saved at function entry
         stp	x27, x28, [sp, #-16]!
@@ -241,7 +247,9 @@ _await_ok:
 	ldr	x3, [x2]
 	str	x3, [x0]
 	# Deactivate thread
-	str	x2, [x2]
+	# (a release, so whichever pthread resumes it next
+	#  sees the saved sp and everything this thread wrote)
+	stlr	x2, [x2]
 
 	# return wait_for
 	mov	x0, x1
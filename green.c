@@ -26,8 +26,25 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
 #include "green.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
 
 #if defined(__linux__)
  #define S_LINUX 1
@@ -55,12 +72,119 @@
  #error unsupported target operating system
 #endif
 
+#if A_LX64
+ #define _CPU_RELAX()   __builtin_ia32_pause()
+#elif A_ARM64
+ #define _CPU_RELAX()   __asm__ __volatile__ ("yield" ::: "memory")
+#endif
+
 
 struct _green_thread {
     green_thread_t last_active;
 };
 
 
+/*
+ * C view of the stack header built by green_spawn
+ * (see the green.*.s files for the authoritative layout).
+ * On x86_64 the handle points just past the top of the header,
+ * while on AArch64 it points at the bottom of it.
+ */
+#if A_LX64
+struct _green_header {
+    struct green_cleanup *cleanup;
+    size_t alloc_length;
+    void *arguments;
+    green_start_t start;
+    void *sp;
+    green_thread_t last_active;
+};
+ #define _HEADER(thread)    ((struct _green_header *)(thread) - 1)
+ #define _THREAD(header)    ((green_thread_t)((struct _green_header *)(header) + 1))
+ #define _STACK_TOP(thread) ((char *)(thread))
+ // Saved registers and return address that resume pops on first entry
+ #define _INITIAL_FRAME     56
+#elif A_ARM64
+struct _green_header {
+    green_thread_t last_active;
+    size_t alloc_length;
+    green_start_t start;
+    void *arguments;
+    void *sp;
+    struct green_cleanup *cleanup;
+};
+ #define _HEADER(thread)    ((struct _green_header *)(thread))
+ #define _THREAD(header)    ((green_thread_t)(header))
+ #define _STACK_TOP(thread) ((char *)(thread) + sizeof(struct _green_header))
+ #define _INITIAL_FRAME     96
+#endif
+
+#define _STACK_BASE(thread) (_STACK_TOP(thread) - _HEADER(thread)->alloc_length)
+
+/*
+ * A coroutine's place in a green_sched ready queue.
+ * Ready coroutines form a pairing heap,
+ * where `prev` is the parent for a first child
+ * and the previous sibling otherwise.
+ * Coroutines made ready from other pthreads are first pushed onto
+ * the scheduler's remote stack through `remote_next`.
+ */
+struct _green_task {
+    struct _green_task *child;
+    struct _green_task *sibling;
+    struct _green_task *prev;
+    struct green_sched *sched;
+    green_resume_t value;
+    unsigned long long deadline;
+    unsigned long long seq;
+    struct _green_task *remote_next;
+    green_resume_t remote_value;
+    int priority;
+    int queued;
+    int remote;
+};
+
+// Values of _green_task::remote
+#define _REMOTE_NONE        0
+#define _REMOTE_PENDING     1   // in some scheduler's inbox
+#define _REMOTE_RELEASED    2   // released while pending; the drain frees it
+
+/* A coroutine's membership of a green_group. */
+struct _green_member {
+    struct green_group *group;
+    green_thread_t next;
+    green_thread_t prev;
+};
+
+/*
+ * Extra per-coroutine state, kept directly below the header
+ * so that it is at a fixed offset from the handle on every platform.
+ * Its size must match _GREEN_EXT_SIZE in the green.*.s files.
+ */
+struct _green_ext {
+    void *locals[GREEN_LOCALS];
+    struct _green_task task;
+    unsigned long overruns;
+    struct _green_member member;
+    struct green_sched *home;
+    int pinned;
+    unsigned char bound;
+    unsigned char offloaded;
+    size_t args_size;
+    struct _green_slab *slab;
+    struct _green_account *account;
+} __attribute__((aligned(16)));
+
+#define _GREEN_EXT_SIZE     224
+#define _EXT(thread)        ((struct _green_ext *)_HEADER(thread) - 1)
+#define _EXT_THREAD(ext)    _THREAD((struct _green_ext *)(ext) + 1)
+#define _TASK_THREAD(node)  \
+    _EXT_THREAD((char *)(node) - offsetof(struct _green_ext, task))
+
+_Static_assert(sizeof(struct _green_ext) == _GREEN_EXT_SIZE,
+               "struct _green_ext does not match the assembler");
+
+
 #ifdef _GREEN_ASM_DEBUG
  #ifndef _GREEN_EXPORT_INTERNALS
   #define _GREEN_EXPORT_INTERNALS
@@ -79,9 +203,2381 @@ struct _green_thread {
  #define _STATIC static
 #endif
 
+// Exported for green_inline.h
+__thread green_thread_t _green_active = NULL;
+__thread unsigned long _green_switches = 0;
+
 _STATIC green_thread_t *__attribute__((used))
 _green_current()
 {
-    static __thread green_thread_t current = NULL;
-    return &current;
+    return &_green_active;
+}
+
+// As _green_current, but also hands green_resume the switch count,
+// which it bumps for the watchdog once activation succeeds
+struct _green_resuming {
+    green_thread_t *active;
+    unsigned long *switches;
+};
+
+_STATIC struct _green_resuming __attribute__((used))
+_green_resuming()
+{
+    return (struct _green_resuming){ &_green_active, &_green_switches };
+}
+
+green_thread_t green_self(void)
+{
+    return _green_active;
+}
+
+
+/*
+ * Take a parked coroutine away from green_resume for a moment.
+ * This is the same activation that green_resume performs,
+ * so a successful claim guarantees nobody else can run the coroutine
+ * until _green_unclaim is called.
+ */
+static int _green_claim(green_thread_t thread)
+{
+    green_thread_t expect = thread;
+    return __atomic_compare_exchange_n(
+        &_HEADER(thread)->last_active, &expect, *_green_current(),
+        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED
+    );
+}
+
+static void _green_unclaim(green_thread_t thread)
+{
+    __atomic_store_n(&_HEADER(thread)->last_active, thread, __ATOMIC_RELEASE);
+}
+
+
+#define _MPOL_DEFAULT       0
+#define _MPOL_BIND          2
+#define _MPOL_MF_MOVE       (1 << 1)
+#define _NUMA_NODES_MAX     1024
+
+int green_bind(green_thread_t thread, int node)
+{
+    unsigned long nodemask[_NUMA_NODES_MAX / (8 * sizeof(unsigned long))] = { 0 };
+    unsigned cpu, current_node;
+    long ret;
+
+    if (node < 0) {
+        if (syscall(SYS_getcpu, &cpu, &current_node, NULL) != 0)
+            return -1;
+        node = current_node;
+    }
+
+    if (node >= _NUMA_NODES_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    nodemask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+
+    if (!_green_claim(thread)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    // Pages already touched get moved, the rest are placed on first touch
+    ret = syscall(SYS_mbind,
+        _STACK_BASE(thread), _HEADER(thread)->alloc_length,
+        _MPOL_BIND, nodemask, _NUMA_NODES_MAX + 1, _MPOL_MF_MOVE);
+    if (ret == 0)
+        _EXT(thread)->bound = 1;
+
+    _green_unclaim(thread);
+    return ret == 0 ? 0 : -1;
+}
+
+
+void *green_spawn_args(green_thread_t thread, size_t size)
+{
+    struct _green_header *header = _HEADER(thread);
+    struct _green_ext *ext = _EXT(thread);
+    char *frame = (char *)ext - ext->args_size - _INITIAL_FRAME;
+
+    // Once started, the saved stack pointer is always below the first frame
+    if (header->sp != frame) {
+        errno = EALREADY;
+        return NULL;
+    }
+
+    size = (size + 15) & ~(size_t)15;
+    if (size > header->alloc_length / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memmove(frame - size, frame, _INITIAL_FRAME);
+    header->sp = frame - size;
+    header->arguments = frame - size + _INITIAL_FRAME;
+    ext->args_size += size;
+    return header->arguments;
+}
+
+
+/*
+ * Stacks of up to GREEN_STACK_MAX bytes are rounded up to a power of two
+ * and carved out of per-class slabs of 64 stacks each.
+ * Each slab tracks which stacks are in use with one bit apiece,
+ * so allocating is a scan for a clear bit and freeing clears it again.
+ * Slabs are never unmapped, so the list of them can be walked without a lock;
+ * the lock only keeps two pthreads from adding a slab at once.
+ *
+ * Stacks of _GUARD_MIN pages or more start with an inaccessible page,
+ * so running off the bottom faults instead of overwriting the header
+ * of the stack below; smaller ones are packed without a gap.
+ * Freed stacks keep whatever pages they touched for their next user.
+ */
+struct _green_slab {
+    char *base;
+    struct _green_slab *next;
+    uint64_t used;
+    unsigned size_class;
+};
+
+struct _green_size_class {
+    struct _green_slab *slabs;
+    struct _green_slab *hint;
+    size_t n_slabs;
+    size_t in_use;
+    size_t peak;
+    unsigned long long allocs;
+};
+
+#define _SLAB_STACKS    64
+#define _GUARD_MIN      16
+
+static size_t _page_size(void)
+{
+    static size_t size;
+    if (size == 0)
+        size = (size_t)sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+// The guard page at the bottom of a stack this size, if it gets one
+static size_t _guard_size(size_t size)
+{
+    return size >= _GUARD_MIN * _page_size() ? _page_size() : 0;
+}
+
+static struct _green_size_class _size_classes[GREEN_STACK_CLASSES];
+static pthread_mutex_t _slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int _slab_take(struct _green_slab *slab)
+{
+    uint64_t used = __atomic_load_n(&slab->used, __ATOMIC_RELAXED);
+    int bit;
+
+    while (~used != 0) {
+        bit = __builtin_ctzll(~used);
+        if (__atomic_compare_exchange_n(
+            &slab->used, &used, used | (1ULL << bit),
+            1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED
+        ))
+            return bit;
+    }
+
+    return -1;
+}
+
+/*
+ * Memory accounting: each pthread charges what its spawns take
+ * to its own account as well as to the process-wide one.
+ * A coroutine remembers whose account it was charged to
+ * and credits that one back wherever it is released,
+ * so accounts outlive their pthreads and are never freed.
+ */
+struct _green_account {
+    size_t live;
+    size_t reserved;
+    size_t committed;
+};
+
+static struct _green_account _account_total;
+static __thread struct _green_account *_account_self;
+static size_t _limit_live, _limit_committed;
+
+static struct _green_account *_account_get(void)
+{
+    if (_account_self == NULL)
+        _account_self = calloc(1, sizeof(*_account_self));
+    return _account_self;
+}
+
+static void _account_charge(
+    struct _green_account *account, ssize_t live, ssize_t reserved, ssize_t committed
+) {
+    __atomic_fetch_add(&account->live, live, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&account->reserved, reserved, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&account->committed, committed, __ATOMIC_RELAXED);
+}
+
+// Charge a new coroutine to the process, unless that would break a limit
+static int _account_admit(size_t size)
+{
+    size_t max_live = __atomic_load_n(&_limit_live, __ATOMIC_RELAXED);
+    size_t max_committed = __atomic_load_n(&_limit_committed, __ATOMIC_RELAXED);
+    size_t live = __atomic_add_fetch(&_account_total.live, 1, __ATOMIC_RELAXED);
+    size_t committed = __atomic_add_fetch(&_account_total.committed, size, __ATOMIC_RELAXED);
+
+    if ((max_live != 0 && live > max_live)
+        || (max_committed != 0 && committed > max_committed)) {
+        __atomic_fetch_sub(&_account_total.live, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&_account_total.committed, size, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void _account_read(struct green_mem_stats *stats, struct _green_account *account)
+{
+    stats->live = __atomic_load_n(&account->live, __ATOMIC_RELAXED);
+    stats->reserved = __atomic_load_n(&account->reserved, __ATOMIC_RELAXED);
+    stats->committed = __atomic_load_n(&account->committed, __ATOMIC_RELAXED);
+}
+
+void green_mem_stats(struct green_mem_stats *stats)
+{
+    _account_read(stats, &_account_total);
+}
+
+void green_mem_stats_self(struct green_mem_stats *stats)
+{
+    static struct _green_account none;
+    _account_read(stats, _account_self != NULL ? _account_self : &none);
+}
+
+void green_mem_limit(size_t max_live, size_t max_committed)
+{
+    __atomic_store_n(&_limit_live, max_live, __ATOMIC_RELAXED);
+    __atomic_store_n(&_limit_committed, max_committed, __ATOMIC_RELAXED);
+}
+
+static struct _green_slab *_slab_add(unsigned size_class, struct _green_slab *seen)
+{
+    struct _green_size_class *sc = &_size_classes[size_class];
+    size_t size = (size_t)GREEN_STACK_MIN << size_class, guard, i;
+    struct _green_slab *slab;
+
+    pthread_mutex_lock(&_slab_lock);
+    slab = __atomic_load_n(&sc->slabs, __ATOMIC_ACQUIRE);
+    if (slab != seen)
+        goto done;  // Someone else just added one
+
+    slab = malloc(sizeof(*slab));
+    if (slab == NULL)
+        goto done;
+
+    slab->base = mmap(NULL, size * _SLAB_STACKS, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slab->base == MAP_FAILED) {
+        free(slab);
+        slab = NULL;
+        goto done;
+    }
+
+    guard = _guard_size(size);
+    for (i = 0; guard != 0 && i < _SLAB_STACKS; i += 1) {
+        if (mprotect(slab->base + i * size, guard, PROT_NONE) != 0) {
+            munmap(slab->base, size * _SLAB_STACKS);
+            free(slab);
+            slab = NULL;
+            goto done;
+        }
+    }
+
+    slab->next = seen;
+    slab->used = 0;
+    slab->size_class = size_class;
+    _account_charge(&_account_total, 0, size * _SLAB_STACKS, 0);
+    _account_charge(_account_self, 0, size * _SLAB_STACKS, 0);
+    __atomic_fetch_add(&sc->n_slabs, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&sc->slabs, slab, __ATOMIC_RELEASE);
+
+done:
+    pthread_mutex_unlock(&_slab_lock);
+    return slab;
+}
+
+/*
+ * Allocate a stack of at least *length bytes for green_spawn,
+ * updating *length to the size actually allocated.
+ * The header and extension area at the top come back zeroed.
+ * Fails with EAGAIN if green_mem_limit says there is no room.
+ */
+_STATIC char *__attribute__((used))
+_green_stack_alloc(size_t *length)
+{
+    struct _green_account *account = _account_get();
+    struct _green_size_class *sc;
+    struct _green_slab *head, *slab;
+    struct _green_ext *ext;
+    unsigned size_class = 0;
+    size_t size = GREEN_STACK_MIN, in_use, peak;
+    char *base;
+    int bit = -1;
+
+    if (account == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (*length > GREEN_STACK_MAX - _guard_size(GREEN_STACK_MAX)) {
+        if (*length > SIZE_MAX - 2 * _page_size()) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        size = (*length + _page_size() - 1) & ~(_page_size() - 1);
+        size += _page_size();
+        if (!_account_admit(size)) {
+            errno = EAGAIN;
+            return NULL;
+        }
+
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            _account_charge(&_account_total, -1, 0, -(ssize_t)size);
+            return NULL;
+        }
+        if (mprotect(base, _page_size(), PROT_NONE) != 0) {
+            munmap(base, size);
+            _account_charge(&_account_total, -1, 0, -(ssize_t)size);
+            return NULL;
+        }
+
+        _account_charge(&_account_total, 0, size, 0);
+        _account_charge(account, 1, size, size);
+        ext = (struct _green_ext *)(base + size - sizeof(struct _green_header)) - 1;
+        ext->account = account;
+        *length = size;
+        return base;
+    }
+
+    while (size - _guard_size(size) < *length) {
+        size <<= 1;
+        size_class += 1;
+    }
+
+    if (!_account_admit(size)) {
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    sc = &_size_classes[size_class];
+    for (;;) {
+        head = __atomic_load_n(&sc->slabs, __ATOMIC_ACQUIRE);
+
+        // Start from wherever the last allocation found room
+        slab = __atomic_load_n(&sc->hint, __ATOMIC_RELAXED);
+        if (slab != NULL && (bit = _slab_take(slab)) >= 0)
+            break;
+        for (slab = head; slab != NULL; slab = slab->next) {
+            if ((bit = _slab_take(slab)) >= 0)
+                break;
+        }
+        if (slab != NULL)
+            break;
+
+        if (_slab_add(size_class, head) == NULL
+            && __atomic_load_n(&sc->slabs, __ATOMIC_ACQUIRE) == head) {
+            _account_charge(&_account_total, -1, 0, -(ssize_t)size);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    __atomic_store_n(&sc->hint, slab, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sc->allocs, 1, __ATOMIC_RELAXED);
+    in_use = __atomic_add_fetch(&sc->in_use, 1, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&sc->peak, __ATOMIC_RELAXED);
+    while (in_use > peak && !__atomic_compare_exchange_n(
+        &sc->peak, &peak, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+    )) {}
+
+    // The last user of this stack may have left its header behind
+    base = slab->base + (size_t)bit * size;
+    ext = (struct _green_ext *)(base + size - sizeof(struct _green_header)) - 1;
+    memset(ext, 0, sizeof(*ext) + sizeof(struct _green_header));
+    ext->slab = slab;
+    ext->account = account;
+    _account_charge(account, 1, 0, size);
+
+    *length = size;
+    return base;
+}
+
+static void _green_stack_free(green_thread_t thread)
+{
+    struct _green_slab *slab = _EXT(thread)->slab;
+    struct _green_account *account = _EXT(thread)->account;
+    size_t size, bit;
+
+    if (slab == NULL) {
+        size = _HEADER(thread)->alloc_length;
+        _account_charge(account, -1, -(ssize_t)size, -(ssize_t)size);
+        _account_charge(&_account_total, -1, -(ssize_t)size, -(ssize_t)size);
+        munmap(_STACK_BASE(thread), size);
+        return;
+    }
+
+    size = (size_t)GREEN_STACK_MIN << slab->size_class;
+    bit = (size_t)(_STACK_BASE(thread) - slab->base) / size;
+
+    // A binding would otherwise stay with the slot for its next user
+    if (_EXT(thread)->bound)
+        syscall(SYS_mbind, _STACK_BASE(thread), size,
+            _MPOL_DEFAULT, NULL, 0, 0);
+
+    _account_charge(account, -1, 0, -(ssize_t)size);
+    _account_charge(&_account_total, -1, 0, -(ssize_t)size);
+    __atomic_fetch_sub(&_size_classes[slab->size_class].in_use, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_and(&slab->used, ~(1ULL << bit), __ATOMIC_RELEASE);
+}
+
+int green_stack_stats(struct green_stack_stats *stats, size_t n)
+{
+    struct _green_size_class *sc;
+    size_t i;
+
+    if (n > GREEN_STACK_CLASSES)
+        n = GREEN_STACK_CLASSES;
+
+    for (i = 0; i < n; i += 1) {
+        sc = &_size_classes[i];
+        stats[i].size = (size_t)GREEN_STACK_MIN << i;
+        stats[i].slabs = __atomic_load_n(&sc->n_slabs, __ATOMIC_RELAXED);
+        stats[i].in_use = __atomic_load_n(&sc->in_use, __ATOMIC_RELAXED);
+        stats[i].peak = __atomic_load_n(&sc->peak, __ATOMIC_RELAXED);
+        stats[i].allocs = __atomic_load_n(&sc->allocs, __ATOMIC_RELAXED);
+    }
+
+    return (int)n;
+}
+
+
+static void _task_remove(struct _green_task *task);
+static void _group_leave(green_thread_t thread);
+
+/*
+ * Release everything held by a coroutine that will never run again.
+ * Called from _thread_return (on the stack of whoever resumed the thread)
+ * and from green_cancel.
+ */
+_STATIC void __attribute__((used))
+_green_release(green_thread_t thread)
+{
+    struct _green_header *header = _HEADER(thread);
+    struct green_cleanup *cleanup;
+
+    while ((cleanup = header->cleanup) != NULL) {
+        header->cleanup = cleanup->next;
+        cleanup->routine(cleanup->arg);
+    }
+
+    if (_EXT(thread)->task.queued)
+        _task_remove(&_EXT(thread)->task);
+    if (_EXT(thread)->member.group != NULL)
+        _group_leave(thread);
+
+    // A scheduler's inbox still points at the stack,
+    // so leave it for _sched_take_remote to free
+    if (__atomic_exchange_n(&_EXT(thread)->task.remote, _REMOTE_RELEASED,
+                            __ATOMIC_ACQ_REL) == _REMOTE_PENDING)
+        return;
+
+    _green_stack_free(thread);
+}
+
+/* Start pulling a coroutine's header into cache. */
+static inline void _prefetch_header(green_thread_t thread)
+{
+    __builtin_prefetch(_HEADER(thread), 1, 3);
+}
+
+/* Start pulling the top of a coroutine's saved stack into cache. */
+static inline void _prefetch_stack(green_thread_t thread)
+{
+    char *sp = _HEADER(thread)->sp;
+    __builtin_prefetch(sp, 0, 3);
+    __builtin_prefetch(sp + 64, 0, 3);
+}
+
+size_t green_resume_many(
+    const green_thread_t *threads,
+    const green_resume_t *values,
+    size_t n,
+    green_await_t *out
+) {
+    green_await_t awaited;
+    size_t i, count = 0;
+
+    if (n > 0)
+        _prefetch_header(threads[0]);
+    if (n > 1)
+        _prefetch_header(threads[1]);
+
+    for (i = 0; i < n; i += 1) {
+        // The next header was fetched one iteration ago,
+        // so its stack pointer should be ready to follow
+        if (i + 1 < n)
+            _prefetch_stack(threads[i + 1]);
+        if (i + 2 < n)
+            _prefetch_header(threads[i + 2]);
+
+        awaited = green_resume(threads[i], values != NULL ? values[i] : NULL);
+        if (awaited != GREEN_RESUME_FAILED)
+            count += 1;
+        if (out != NULL)
+            out[i] = awaited;
+    }
+
+    return count;
+}
+
+int green_cancel(green_thread_t thread)
+{
+    if (!_green_claim(thread)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    // A helper still holds the job on its stack
+    if (_EXT(thread)->offloaded) {
+        _green_unclaim(thread);
+        errno = EBUSY;
+        return -1;
+    }
+
+    _green_release(thread);
+    return 0;
+}
+
+
+/*
+ * Values of green_deferred::state.
+ * Whoever moves it to _DEFERRED_RUNNING owns the coroutine
+ * until they move it on again, so only they may spawn, resume or free it.
+ */
+#define _DEFERRED_UNSTARTED 0
+#define _DEFERRED_IDLE      1   // spawned, and waiting to be resumed
+#define _DEFERRED_RUNNING   2
+#define _DEFERRED_FINISHED  3
+
+void green_spawn_deferred(
+    struct green_deferred *deferred,
+    green_start_t start,
+    void *arguments,
+    size_t hint
+) {
+    deferred->start = start;
+    deferred->arguments = arguments;
+    deferred->hint = hint;
+    deferred->thread = NULL;
+    deferred->state = _DEFERRED_UNSTARTED;
+}
+
+// Take the coroutine over, remembering where it was up to
+static int _deferred_claim(struct green_deferred *deferred, int *state)
+{
+    *state = __atomic_load_n(&deferred->state, __ATOMIC_ACQUIRE);
+    while (*state == _DEFERRED_UNSTARTED || *state == _DEFERRED_IDLE) {
+        if (__atomic_compare_exchange_n(
+            &deferred->state, state, _DEFERRED_RUNNING,
+            1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE
+        ))
+            return 1;
+    }
+
+    errno = *state == _DEFERRED_RUNNING ? EBUSY : ESRCH;
+    return 0;
+}
+
+green_await_t green_deferred_resume(
+    struct green_deferred *deferred,
+    green_resume_t resume_with
+) {
+    green_await_t awaited;
+    int state;
+
+    if (!_deferred_claim(deferred, &state))
+        return GREEN_RESUME_FAILED;
+
+    if (state == _DEFERRED_UNSTARTED) {
+        deferred->thread = green_spawn(
+            deferred->start, deferred->arguments, deferred->hint);
+        if (deferred->thread == NULL) {
+            __atomic_store_n(&deferred->state, _DEFERRED_UNSTARTED, __ATOMIC_RELEASE);
+            return GREEN_RESUME_FAILED;
+        }
+    }
+
+    awaited = green_resume(deferred->thread, resume_with);
+    if (awaited == NULL) {
+        deferred->thread = NULL;
+        state = _DEFERRED_FINISHED;
+    } else {
+        state = _DEFERRED_IDLE;
+    }
+
+    __atomic_store_n(&deferred->state, state, __ATOMIC_RELEASE);
+    return awaited;
+}
+
+int green_deferred_cancel(struct green_deferred *deferred)
+{
+    int state;
+
+    if (!_deferred_claim(deferred, &state))
+        return state == _DEFERRED_FINISHED ? 0 : -1;
+
+    if (state == _DEFERRED_IDLE && green_cancel(deferred->thread) != 0) {
+        __atomic_store_n(&deferred->state, _DEFERRED_IDLE, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    deferred->thread = NULL;
+    __atomic_store_n(&deferred->state, _DEFERRED_FINISHED, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void green_cleanup_push(
+    struct green_cleanup *cleanup,
+    void (*routine)(void *arg),
+    void *arg
+) {
+    green_thread_t current = *_green_current();
+    if (current == NULL)
+        return;
+
+    cleanup->routine = routine;
+    cleanup->arg = arg;
+    cleanup->next = _HEADER(current)->cleanup;
+    _HEADER(current)->cleanup = cleanup;
+}
+
+void green_cleanup_pop(int execute)
+{
+    green_thread_t current = *_green_current();
+    struct green_cleanup *cleanup;
+    if (current == NULL || (cleanup = _HEADER(current)->cleanup) == NULL)
+        return;
+
+    _HEADER(current)->cleanup = cleanup->next;
+    if (execute)
+        cleanup->routine(cleanup->arg);
+}
+
+
+static __thread void *_root_locals[GREEN_LOCALS];
+static int _locals_used = 0;
+
+int green_local_key(void)
+{
+    int key = __atomic_fetch_add(&_locals_used, 1, __ATOMIC_RELAXED);
+    if (key >= GREEN_LOCALS) {
+        __atomic_store_n(&_locals_used, GREEN_LOCALS, __ATOMIC_RELAXED);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return key;
+}
+
+void *green_local_get(int key)
+{
+    green_thread_t current = *_green_current();
+    return (current ? _EXT(current)->locals : _root_locals)[key];
+}
+
+void green_local_set(int key, void *value)
+{
+    green_thread_t current = *_green_current();
+    (current ? _EXT(current)->locals : _root_locals)[key] = value;
+}
+
+
+int green_gen_start(struct green_gen *gen, green_start_t producer, size_t hint)
+{
+    gen->count = 0;
+    gen->next = 0;
+    gen->done = 0;
+    gen->thread = green_spawn(producer, gen, hint);
+    return gen->thread == NULL ? -1 : 0;
+}
+
+int green_gen_flush(struct green_gen *gen)
+{
+    if (gen->count == 0)
+        return 0;
+
+    green_resume_t next = green_await((green_await_t)gen);
+    if (next == GREEN_AWAIT_FAILED) {
+        errno = EPERM;
+        return -1;
+    }
+
+    return 0;
+}
+
+int green_gen_yield(struct green_gen *gen, const void *item)
+{
+    // Still full because an earlier flush failed
+    if (gen->count >= gen->capacity) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    memcpy((char *)gen->buffer + gen->count * gen->item_size,
+           item, gen->item_size);
+    gen->count += 1;
+
+    if (gen->count < gen->capacity)
+        return 0;
+    return green_gen_flush(gen);
+}
+
+size_t green_gen_fill(struct green_gen *gen)
+{
+    green_await_t awon;
+
+    if (gen->next < gen->count)
+        return gen->count - gen->next;
+
+    gen->count = 0;
+    gen->next = 0;
+    while (!gen->done && gen->count == 0) {
+        awon = green_resume(gen->thread, (green_resume_t)gen);
+        if (awon == NULL) {
+            gen->done = 1;
+        } else if (awon != (green_await_t)gen) {
+            errno = EPROTO;
+            return 0;
+        }
+    }
+
+    return gen->count;
+}
+
+void *green_gen_next(struct green_gen *gen)
+{
+    if (gen->next == gen->count && green_gen_fill(gen) == 0)
+        return NULL;
+
+    return (char *)gen->buffer + (gen->next++) * gen->item_size;
+}
+
+void green_gen_close(struct green_gen *gen)
+{
+    if (!gen->done && green_cancel(gen->thread) == 0)
+        gen->done = 1;
+}
+
+
+/*
+ * An offloaded job.
+ * This lives in the frame of green_offload, on the coroutine's stack,
+ * and `next` links it first into the pool's pending list
+ * and then into the queue's completed list.
+ * Until the coroutine is resumed from there, green_cancel refuses it.
+ */
+struct _green_offload {
+    void (*func)(void *arg);
+    void *arg;
+    green_thread_t thread;
+    struct green_offload_queue *queue;
+    struct _green_offload *next;
+};
+
+struct green_offload_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct _green_offload *head;
+    struct _green_offload *tail;
+    int stopping;
+    size_t n_threads;
+    pthread_t threads[];
+};
+
+static void _offload_complete(struct _green_offload *job)
+{
+    struct green_offload_queue *queue = job->queue;
+    struct _green_offload *head = __atomic_load_n(&queue->done, __ATOMIC_RELAXED);
+
+    // The job must not be touched after this succeeds,
+    // since the coroutine it lives on may be resumed straight away.
+    do {
+        job->next = head;
+    } while (!__atomic_compare_exchange_n(
+        &queue->done, &head, job,
+        1, __ATOMIC_RELEASE, __ATOMIC_RELAXED
+    ));
+
+    // Only the first completion needs to wake the owner;
+    // everything after it gets picked up by the same drain.
+    if (head == NULL)
+        eventfd_write(queue->fd, 1);
+}
+
+static void *_offload_helper(void *arg)
+{
+    struct green_offload_pool *pool = arg;
+    struct _green_offload *job;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head == NULL && !pool->stopping)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+
+        if ((job = pool->head) == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+
+        if ((pool->head = job->next) == NULL)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->func(job->arg);
+        _offload_complete(job);
+    }
+}
+
+struct green_offload_pool *green_offload_pool_create(size_t n_threads)
+{
+    struct green_offload_pool *pool;
+    int err;
+
+    if (n_threads == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pool = calloc(1, sizeof(*pool) + n_threads * sizeof(pthread_t));
+    if (pool == NULL)
+        return NULL;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for (; pool->n_threads < n_threads; pool->n_threads += 1) {
+        err = pthread_create(&pool->threads[pool->n_threads], NULL,
+                             _offload_helper, pool);
+        if (err != 0) {
+            green_offload_pool_destroy(pool);
+            errno = err;
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void green_offload_pool_destroy(struct green_offload_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->n_threads; i += 1)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+int green_offload_queue_init(struct green_offload_queue *queue)
+{
+    queue->done = NULL;
+    queue->ready = NULL;
+    queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return queue->fd < 0 ? -1 : 0;
+}
+
+void green_offload_queue_destroy(struct green_offload_queue *queue)
+{
+    close(queue->fd);
+    queue->fd = -1;
+}
+
+int green_offload(
+    struct green_offload_pool *pool,
+    struct green_offload_queue *queue,
+    void (*func)(void *arg),
+    void *arg
+) {
+    struct _green_offload job = {
+        .func = func,
+        .arg = arg,
+        .thread = *_green_current(),
+        .queue = queue,
+        .next = NULL,
+    };
+
+    if (job.thread == NULL) {
+        // Nothing else would be able to run anyway
+        func(arg);
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stopping) {
+        pthread_mutex_unlock(&pool->lock);
+        errno = ECANCELED;
+        return -1;
+    }
+
+    if (pool->tail == NULL)
+        pool->head = &job;
+    else
+        pool->tail->next = &job;
+    pool->tail = &job;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    _EXT(job.thread)->offloaded = 1;
+    green_await(GREEN_OFFLOADED);
+    _EXT(job.thread)->offloaded = 0;
+    return 0;
+}
+
+static struct _green_offload *_offload_take(struct green_offload_queue *queue)
+{
+    struct _green_offload *list, *next;
+
+    list = __atomic_exchange_n(&queue->done, NULL, __ATOMIC_ACQUIRE);
+
+    // Completions are pushed LIFO; put them back in order
+    while (list != NULL) {
+        next = list->next;
+        list->next = queue->ready;
+        queue->ready = list;
+        list = next;
+    }
+
+    return queue->ready;
+}
+
+green_thread_t green_offload_poll(struct green_offload_queue *queue)
+{
+    struct _green_offload *job = queue->ready;
+    eventfd_t count;
+
+    if (job == NULL && (job = _offload_take(queue)) == NULL) {
+        // Only clear the wakeup once there's nothing left,
+        // then check again in case something raced in.
+        eventfd_read(queue->fd, &count);
+        if ((job = _offload_take(queue)) == NULL)
+            return NULL;
+    }
+
+    queue->ready = job->next;
+    return job->thread;
+}
+
+
+static __thread green_poll_t _poll_hook = NULL;
+
+green_poll_t green_set_poll(green_poll_t hook)
+{
+    green_poll_t previous = _poll_hook;
+    _poll_hook = hook;
+    return previous;
+}
+
+green_poll_t green_get_poll(void)
+{
+    return *_green_current() == NULL ? NULL : _poll_hook;
+}
+
+int green_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    green_poll_t hook = green_get_poll();
+    if (hook == NULL)
+        return poll(fds, nfds, timeout);
+
+    return hook(fds, nfds, timeout);
+}
+
+
+ssize_t green_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    struct pollfd pfd = { out_fd, POLLOUT, 0 };
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < count) {
+        n = sendfile(out_fd, in_fd, offset, count - sent);
+        if (n > 0) {
+            sent += n;
+        } else if (n == 0) {
+            break;
+        } else if (errno == EAGAIN) {
+            if (green_poll(&pfd, 1, -1) < 0)
+                return sent > 0 ? (ssize_t)sent : -1;
+        } else if (errno != EINTR) {
+            return sent > 0 ? (ssize_t)sent : -1;
+        }
+    }
+
+    return sent;
+}
+
+ssize_t green_splice(
+    int in_fd, int64_t *in_offset,
+    int out_fd, int64_t *out_offset,
+    size_t count, unsigned flags
+) {
+    struct pollfd fds[2] = { { in_fd, POLLIN, 0 }, { out_fd, POLLOUT, 0 } };
+    size_t moved = 0;
+    ssize_t n;
+
+    while (moved < count) {
+        n = splice(in_fd, in_offset, out_fd, out_offset,
+                   count - moved, flags | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            moved += n;
+            continue;
+        } else if (n == 0) {
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN) {
+            return moved > 0 ? (ssize_t)moved : -1;
+        }
+
+        // Either side may be the one holding things up;
+        // wait on whichever isn't ready yet,
+        // or back off for a moment if both say they are
+        poll(fds, 2, 0);
+        if (fds[0].revents && fds[1].revents)
+            n = green_poll(NULL, 0, 1);
+        else
+            n = green_poll(fds[1].revents ? &fds[0] : &fds[1], 1, -1);
+        if (n < 0)
+            return moved > 0 ? (ssize_t)moved : -1;
+    }
+
+    return moved;
+}
+
+
+static __thread struct green_sched *_sched_current = NULL;
+
+static int _task_before(struct _green_task *a, struct _green_task *b)
+{
+    if (a->priority != b->priority)
+        return a->priority < b->priority;
+    else if (a->deadline != b->deadline)
+        return a->deadline - 1 < b->deadline - 1;  // zero (no deadline) last
+    return a->seq < b->seq;
+}
+
+static struct _green_task *_task_meld(struct _green_task *a, struct _green_task *b)
+{
+    struct _green_task *swap;
+
+    if (a == NULL)
+        return b;
+    else if (b == NULL)
+        return a;
+
+    if (_task_before(b, a)) {
+        swap = a;
+        a = b;
+        b = swap;
+    }
+
+    b->prev = a;
+    b->sibling = a->child;
+    if (a->child != NULL)
+        a->child->prev = b;
+    a->child = b;
+    return a;
+}
+
+/* Standard two-pass merge of a list of siblings. */
+static struct _green_task *_task_merge_pairs(struct _green_task *first)
+{
+    struct _green_task *pairs = NULL, *a, *b, *merged = NULL;
+
+    while ((a = first) != NULL) {
+        b = a->sibling;
+        first = b == NULL ? NULL : b->sibling;
+
+        a->sibling = a->prev = NULL;
+        if (b != NULL)
+            b->sibling = b->prev = NULL;
+
+        a = _task_meld(a, b);
+        a->sibling = pairs;
+        pairs = a;
+    }
+
+    while ((a = pairs) != NULL) {
+        pairs = a->sibling;
+        a->sibling = NULL;
+        merged = _task_meld(merged, a);
+    }
+
+    return merged;
+}
+
+static void _task_remove(struct _green_task *task)
+{
+    struct green_sched *sched = task->sched;
+    struct _green_task *children = task->child;
+
+    if (task == sched->ready) {
+        sched->ready = NULL;
+    } else {
+        if (task->prev->child == task)
+            task->prev->child = task->sibling;
+        else
+            task->prev->sibling = task->sibling;
+        if (task->sibling != NULL)
+            task->sibling->prev = task->prev;
+    }
+
+    task->child = task->sibling = task->prev = NULL;
+    task->queued = 0;
+    // Other pthreads read n_ready when placing coroutines
+    __atomic_store_n(&sched->n_ready, sched->n_ready - 1, __ATOMIC_RELAXED);
+
+    children = _task_merge_pairs(children);
+    sched->ready = _task_meld(sched->ready, children);
+    if (sched->ready != NULL)
+        sched->ready->prev = NULL;
+}
+
+void green_sched_init(struct green_sched *sched)
+{
+    sched->on_await = NULL;
+    sched->context = NULL;
+    sched->migrate_threshold = GREEN_MIGRATE_THRESHOLD;
+    sched->spin_limit = GREEN_SPIN_LIMIT;
+    sched->ready = NULL;
+    sched->remote = NULL;
+    sched->sleeping = 0;
+    sched->woken = 0;
+    sched->seq = 0;
+    sched->n_ready = 0;
+    memset(&sched->stats, 0, sizeof(sched->stats));
+    sched->stats.spin = GREEN_SPIN_LIMIT;
+}
+
+void green_sched_priority(green_thread_t thread, int priority)
+{
+    _EXT(thread)->task.priority = priority;
+}
+
+void green_sched_deadline(green_thread_t thread, unsigned long long deadline)
+{
+    _EXT(thread)->task.deadline = deadline;
+}
+
+int green_sched_ready(
+    struct green_sched *sched,
+    green_thread_t thread,
+    green_resume_t value
+) {
+    struct _green_task *task = &_EXT(thread)->task;
+
+    if (task->queued) {
+        errno = EALREADY;
+        return -1;
+    }
+
+    task->sched = sched;
+    task->value = value;
+    task->seq = sched->seq++;
+    task->queued = 1;
+    __atomic_store_n(&sched->n_ready, sched->n_ready + 1, __ATOMIC_RELAXED);
+    sched->ready = _task_meld(sched->ready, task);
+    return 0;
+}
+
+int green_sched_ready_remote(
+    struct green_sched *sched,
+    green_thread_t thread,
+    green_resume_t value
+) {
+    struct _green_task *task = &_EXT(thread)->task;
+    struct _green_task *head;
+
+    if (__atomic_exchange_n(&task->remote, _REMOTE_PENDING, __ATOMIC_ACQUIRE)) {
+        errno = EALREADY;
+        return -1;
+    }
+
+    // Not task->value, which a local green_sched_ready may still need
+    task->remote_value = value;
+    head = __atomic_load_n(&sched->remote, __ATOMIC_RELAXED);
+    do {
+        task->remote_next = head;
+    } while (!__atomic_compare_exchange_n(
+        &sched->remote, &head, task,
+        1, __ATOMIC_RELEASE, __ATOMIC_RELAXED
+    ));
+
+    green_sched_wake(sched);
+    return 0;
+}
+
+void green_sched_wake(struct green_sched *sched)
+{
+    // The flag keeps the wake for a scheduler that is not asleep yet;
+    // the fence pairs with the one in green_sched_wait,
+    // so either it sees the flag (or our work) or we see it sleeping
+    __atomic_store_n(&sched->woken, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sched->sleeping, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&sched->sleeping, 0, __ATOMIC_RELEASE)) {
+        __atomic_fetch_add(&sched->stats.wakes, 1, __ATOMIC_RELAXED);
+        syscall(SYS_futex, &sched->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+void green_sched_stats(const struct green_sched *sched, struct green_sched_stats *stats)
+{
+    *stats = sched->stats;
+    stats->wakes = __atomic_load_n(&sched->stats.wakes, __ATOMIC_RELAXED);
+}
+
+// Whether there is remote work, or a wake (which this consumes)
+static int _sched_woken(struct green_sched *sched)
+{
+    int woken = __atomic_load_n(&sched->woken, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&sched->woken, 0, __ATOMIC_ACQUIRE);
+    return woken || __atomic_load_n(&sched->remote, __ATOMIC_RELAXED) != NULL;
+}
+
+/*
+ * Poll the inbox for up to the current spin budget.
+ * Work found early stretches the budget towards twice as long as it took
+ * (within spin_limit); spinning in vain halves it.
+ */
+static int _sched_spin(struct green_sched *sched)
+{
+    unsigned spin = sched->stats.spin, i;
+
+    if (spin > sched->spin_limit)
+        spin = sched->spin_limit;
+
+    for (i = 0; i < spin; i += 1) {
+        if (_sched_woken(sched)) {
+            spin += ((int)(2 * i + 16) - (int)spin) / 4;
+            sched->stats.spin = spin < sched->spin_limit ? spin : sched->spin_limit;
+            sched->stats.spin_hits += 1;
+            return 1;
+        }
+
+        // Let other pthreads sharing this CPU (such as the poster) run
+        if (i % 128 == 127)
+            sched_yield();
+        else
+            _CPU_RELAX();
+    }
+
+    sched->stats.spin = spin / 2 > 16 ? spin / 2 : 16;
+    return 0;
+}
+
+int green_sched_wait(struct green_sched *sched, const struct timespec *timeout)
+{
+    struct timespec deadline;
+    int result = 0;
+
+    if (sched->ready != NULL)
+        return 0;
+
+    sched->stats.waits += 1;
+    if (_sched_spin(sched))
+        return 0;
+
+    if (timeout != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout->tv_sec;
+        deadline.tv_nsec += timeout->tv_nsec;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    __atomic_store_n(&sched->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (_sched_woken(sched))
+        goto done;
+
+    sched->stats.sleeps += 1;
+    // The deadline is absolute, so signals (such as the preemption timer)
+    // interrupting the wait do not push it back
+    while (__atomic_load_n(&sched->sleeping, __ATOMIC_ACQUIRE)) {
+        if (syscall(
+            SYS_futex, &sched->sleeping, FUTEX_WAIT_BITSET_PRIVATE, 1,
+            timeout != NULL ? &deadline : NULL, NULL, FUTEX_BITSET_MATCH_ANY
+        ) < 0 && errno == ETIMEDOUT) {
+            sched->stats.timeouts += 1;
+            result = -1;
+            break;
+        }
+    }
+
+done:
+    __atomic_store_n(&sched->sleeping, 0, __ATOMIC_RELAXED);
+    if (result == 0)
+        __atomic_store_n(&sched->woken, 0, __ATOMIC_RELAXED);
+    return result;
+}
+
+static void _sched_take_remote(struct green_sched *sched)
+{
+    struct _green_task *list, *task, *prev = NULL;
+
+    list = __atomic_exchange_n(&sched->remote, NULL, __ATOMIC_ACQUIRE);
+    while (list != NULL) {
+        task = list;
+        list = task->remote_next;
+        task->remote_next = prev;
+        prev = task;
+    }
+
+    while ((task = prev) != NULL) {
+        prev = task->remote_next;
+        if (__atomic_exchange_n(&task->remote, _REMOTE_NONE, __ATOMIC_ACQ_REL)
+            == _REMOTE_RELEASED)
+            _green_stack_free(_TASK_THREAD(task));
+        else if (!task->queued)
+            green_sched_ready(sched, _TASK_THREAD(task), task->remote_value);
+        else if (task->sched == sched && task->value == NULL)
+            // Already made ready here with nothing to say; use what was posted
+            task->value = task->remote_value;
+    }
+}
+
+green_thread_t green_sched_next(struct green_sched *sched, green_resume_t *value)
+{
+    struct _green_task *task;
+
+    if (__atomic_load_n(&sched->remote, __ATOMIC_RELAXED) != NULL)
+        _sched_take_remote(sched);
+
+    task = sched->ready;
+    if (task == NULL)
+        return NULL;
+
+    _task_remove(task);
+    *value = task->value;
+    return _TASK_THREAD(task);
+}
+
+static void _sched_dispatch(
+    struct green_sched *sched,
+    green_thread_t thread,
+    green_await_t awaited
+) {
+    if (awaited == NULL || awaited == GREEN_SCHED_PARK)
+        return;
+    else if (awaited == GREEN_SCHED_YIELD)
+        green_sched_ready(sched, thread, NULL);
+    else if (sched->on_await != NULL)
+        sched->on_await(sched, thread, awaited);
+}
+
+size_t green_sched_run(struct green_sched *sched)
+{
+    struct green_sched *outer = _sched_current;
+    green_thread_t thread;
+    green_resume_t value;
+    green_await_t awaited;
+    size_t count = 0;
+
+    _sched_current = sched;
+    while ((thread = green_sched_next(sched, &value)) != NULL) {
+        if (sched->ready != NULL)
+            _prefetch_header(_TASK_THREAD(sched->ready));
+        green_preempt_reset();
+
+        // Already running (elsewhere, or further up this stack),
+        // so this wake has nothing to resume
+        awaited = green_resume(thread, value);
+        if (awaited == GREEN_RESUME_FAILED)
+            continue;
+
+        // It ran here, so its stack is now warm in this pthread's cache
+        if (awaited != NULL)
+            __atomic_store_n(&_EXT(thread)->home, sched, __ATOMIC_RELAXED);
+
+        _sched_dispatch(sched, thread, awaited);
+        count += 1;
+    }
+
+    _sched_current = outer;
+    return count;
+}
+
+struct green_sched *green_sched_self(void)
+{
+    return _sched_current;
+}
+
+green_resume_t green_sched_yield(void)
+{
+    return green_await(GREEN_SCHED_YIELD);
+}
+
+green_resume_t green_sched_park(void)
+{
+    return green_await(GREEN_SCHED_PARK);
+}
+
+struct green_sched *green_affinity(green_thread_t thread)
+{
+    return __atomic_load_n(&_EXT(thread)->home, __ATOMIC_RELAXED);
+}
+
+void green_pin(green_thread_t thread, int pinned)
+{
+    __atomic_store_n(&_EXT(thread)->pinned, pinned, __ATOMIC_RELAXED);
+}
+
+void green_migrate(green_thread_t thread, struct green_sched *sched)
+{
+    __atomic_store_n(&_EXT(thread)->home, sched, __ATOMIC_RELAXED);
+}
+
+int green_sched_place(
+    struct green_sched *const *scheds,
+    size_t n_scheds,
+    green_thread_t thread,
+    green_resume_t value
+) {
+    struct _green_ext *ext = _EXT(thread);
+    size_t i, home = n_scheds, least = 0, load, least_load = (size_t)-1;
+    struct green_sched *sched = __atomic_load_n(&ext->home, __ATOMIC_RELAXED);
+    int result;
+
+    for (i = 0; i < n_scheds; i += 1) {
+        load = __atomic_load_n(&scheds[i]->n_ready, __ATOMIC_RELAXED);
+        if (load < least_load) {
+            least = i;
+            least_load = load;
+        }
+        if (scheds[i] == sched)
+            home = i;
+    }
+
+    // Stay where the stack is still in cache unless that is badly overloaded
+    if (home < n_scheds && (__atomic_load_n(&ext->pinned, __ATOMIC_RELAXED) ||
+        __atomic_load_n(&scheds[home]->n_ready, __ATOMIC_RELAXED)
+            <= least_load + scheds[home]->migrate_threshold))
+        least = home;
+
+    sched = scheds[least];
+    if (green_sched_self() == sched)
+        result = green_sched_ready(sched, thread, value);
+    else
+        result = green_sched_ready_remote(sched, thread, value);
+
+    if (result != 0)
+        return -1;
+    __atomic_store_n(&ext->home, sched, __ATOMIC_RELAXED);
+    return (int)least;
+}
+
+
+#ifndef sigev_notify_thread_id
+ #define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static unsigned long long _clock_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Signal handlers interrupt whatever coroutine is running,
+ * whose stack may be small and unguarded,
+ * so pthreads that take green's signals get an alternate stack.
+ * It is shared by everything that needs it on the pthread,
+ * and a stack the application already installed is left alone.
+ */
+#define _ALTSTACK_SIZE      (64 * 1024)
+
+static __thread void *_altstack;
+static __thread int _altstack_users = 0;
+
+static int _altstack_acquire(void)
+{
+    stack_t stack = { 0 }, old;
+    size_t guard = _page_size();
+    void *base;
+
+    if (_altstack_users++ > 0)
+        return 0;
+    if (sigaltstack(NULL, &old) == 0 && !(old.ss_flags & SS_DISABLE)) {
+        _altstack = NULL;
+        return 0;
+    }
+
+    base = mmap(NULL, guard + _ALTSTACK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED)
+        goto failed;
+    if (mprotect(base, guard, PROT_NONE) != 0)
+        goto unmap;
+
+    stack.ss_sp = (char *)base + guard;
+    stack.ss_size = _ALTSTACK_SIZE;
+    if (sigaltstack(&stack, NULL) != 0)
+        goto unmap;
+
+    _altstack = base;
+    return 0;
+
+unmap:
+    munmap(base, guard + _ALTSTACK_SIZE);
+failed:
+    _altstack_users -= 1;
+    return -1;
+}
+
+static void _altstack_release(void)
+{
+    stack_t stack = { .ss_flags = SS_DISABLE };
+
+    if (--_altstack_users > 0 || _altstack == NULL)
+        return;
+
+    sigaltstack(&stack, NULL);
+    munmap(_altstack, _page_size() + _ALTSTACK_SIZE);
+    _altstack = NULL;
+}
+
+static __thread volatile sig_atomic_t _preempt_expired = 0;
+static __thread timer_t _preempt_timer;
+static __thread int _preempt_armed = 0;
+static __thread unsigned long long _preempt_slice;    // nanoseconds
+static __thread unsigned long long _preempt_started;
+
+static void _preempt_handler(int signo)
+{
+    (void)signo;
+    _preempt_expired = 1;
+}
+
+int green_preempt_start(unsigned long slice_us)
+{
+    struct sigaction action = { 0 };
+    struct sigevent event = { 0 };
+    struct itimerspec spec = { 0 };
+
+    if (_preempt_armed || slice_us == 0) {
+        errno = _preempt_armed ? EALREADY : EINVAL;
+        return -1;
+    }
+
+    action.sa_handler = _preempt_handler;
+    action.sa_flags = SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(GREEN_PREEMPT_SIGNAL, &action, NULL) != 0)
+        return -1;
+    if (_altstack_acquire() != 0)
+        return -1;
+
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = GREEN_PREEMPT_SIGNAL;
+    event.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_MONOTONIC, &event, &_preempt_timer) != 0) {
+        _altstack_release();
+        return -1;
+    }
+
+    spec.it_value.tv_sec = slice_us / 1000000;
+    spec.it_value.tv_nsec = (slice_us % 1000000) * 1000;
+    spec.it_interval = spec.it_value;
+    if (timer_settime(_preempt_timer, 0, &spec, NULL) != 0) {
+        timer_delete(_preempt_timer);
+        _altstack_release();
+        return -1;
+    }
+
+    _preempt_slice = (unsigned long long)slice_us * 1000;
+    _preempt_started = _clock_now();
+    _preempt_expired = 0;
+    _preempt_armed = 1;
+    return 0;
+}
+
+void green_preempt_stop(void)
+{
+    if (!_preempt_armed)
+        return;
+
+    timer_delete(_preempt_timer);
+    _altstack_release();
+    _preempt_armed = 0;
+    _preempt_expired = 0;
+}
+
+void green_preempt_reset(void)
+{
+    // The timer keeps its own period, so a tick that lands just after
+    // this must not end the new slice; green_maybe_yield checks the time
+    if (_preempt_armed)
+        _preempt_started = _clock_now();
+    _preempt_expired = 0;
+}
+
+int green_maybe_yield(void)
+{
+    green_thread_t current;
+
+    if (!_preempt_expired)
+        return 0;
+
+    _preempt_expired = 0;
+    if (_clock_now() - _preempt_started < _preempt_slice)
+        return 0;
+
+    _preempt_started = _clock_now();
+    if ((current = *_green_current()) == NULL)
+        return 0;
+
+    _EXT(current)->overruns += 1;
+    green_await(GREEN_SCHED_YIELD);
+    return 1;
+}
+
+unsigned long green_preempt_overruns(green_thread_t thread)
+{
+    return _EXT(thread)->overruns;
+}
+
+
+static void _group_wake(struct green_group *group)
+{
+    if (group->waiter != NULL)
+        green_sched_ready(group->sched, group->waiter, NULL);
+}
+
+/* Take a child out of its group, returning how many are left. */
+static size_t _group_detach(green_thread_t thread)
+{
+    struct _green_member *member = &_EXT(thread)->member;
+    struct green_group *group = member->group;
+
+    if (member->prev == NULL)
+        group->children = member->next;
+    else
+        _EXT(member->prev)->member.next = member->next;
+    if (member->next != NULL)
+        _EXT(member->next)->member.prev = member->prev;
+
+    member->group = NULL;
+    return --group->pending;
+}
+
+static void _group_leave(green_thread_t thread)
+{
+    struct green_group *group = _EXT(thread)->member.group;
+
+    if (_group_detach(thread) == 0)
+        _group_wake(group);
+}
+
+void green_group_init(struct green_group *group, struct green_sched *sched)
+{
+    group->sched = sched;
+    group->children = NULL;
+    group->waiter = NULL;
+    group->pending = 0;
+    group->failed = 0;
+}
+
+green_thread_t green_group_spawn(
+    struct green_group *group,
+    green_start_t start,
+    void *arguments,
+    size_t hint
+) {
+    green_thread_t thread = green_spawn(start, arguments, hint);
+    struct _green_member *member;
+    if (thread == NULL)
+        return NULL;
+
+    member = &_EXT(thread)->member;
+    member->group = group;
+    member->prev = NULL;
+    member->next = group->children;
+    if (group->children != NULL)
+        _EXT(group->children)->member.prev = thread;
+    group->children = thread;
+    group->pending += 1;
+
+    green_sched_ready(group->sched, thread, NULL);
+    return thread;
+}
+
+void green_group_fail(struct green_group *group)
+{
+    if (!group->failed) {
+        group->failed = 1;
+        _group_wake(group);
+    }
+}
+
+void green_group_cancel(struct green_group *group)
+{
+    green_thread_t child = group->children, next;
+
+    while (child != NULL) {
+        next = _EXT(child)->member.next;
+
+        // A running child outlives the group (which is often on the
+        // waiter's stack), so it must not report back to it when done
+        if (green_cancel(child) != 0)
+            _group_detach(child);
+        child = next;
+    }
+}
+
+int green_group_wait(struct green_group *group)
+{
+    green_thread_t current = *_green_current();
+
+    while (group->pending > 0 && !group->failed) {
+        if (current != NULL) {
+            group->waiter = current;
+            green_sched_park();
+            group->waiter = NULL;
+        } else if (green_sched_run(group->sched) == 0) {
+            // Everything left is waiting on something else
+            errno = EDEADLK;
+            return -1;
+        }
+    }
+
+    if (group->failed) {
+        green_group_cancel(group);
+        errno = ECANCELED;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Each green_event is idle, set, waited on by a green_select
+ * (in which case it points at the select's state),
+ * or busy while green_event_set is looking at that state.
+ * The select waits for its events to stop being busy before returning,
+ * so that its state (which lives on its stack) stays valid;
+ * a cleanup handler does the same if the coroutine is cancelled instead.
+ */
+#define _EVENT_IDLE     ((uintptr_t)0)
+#define _EVENT_SET      ((uintptr_t)1)
+#define _EVENT_BUSY     ((uintptr_t)2)
+
+struct _green_select {
+    struct green_event *winner;
+    struct green_sched *sched;
+    green_thread_t thread;
+    struct green_event *const *events;
+    size_t n_registered;
+};
+
+void green_event_init(struct green_event *event)
+{
+    event->state = _EVENT_IDLE;
+}
+
+static void _select_wake(struct _green_select *select)
+{
+    if (green_sched_self() == select->sched)
+        green_sched_ready(select->sched, select->thread, NULL);
+    else
+        green_sched_ready_remote(select->sched, select->thread, NULL);
+}
+
+int green_event_set(struct green_event *event)
+{
+    uintptr_t state = __atomic_load_n(&event->state, __ATOMIC_ACQUIRE);
+    struct _green_select *select;
+    struct green_event *none = NULL;
+    int woke;
+
+    for (;;) {
+        if (state == _EVENT_SET) {
+            return 0;
+        } else if (state == _EVENT_BUSY) {
+            sched_yield();
+            state = __atomic_load_n(&event->state, __ATOMIC_ACQUIRE);
+        } else if (state == _EVENT_IDLE) {
+            if (__atomic_compare_exchange_n(
+                &event->state, &state, _EVENT_SET,
+                0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE
+            ))
+                return 0;
+        } else if (__atomic_compare_exchange_n(
+            &event->state, &state, _EVENT_BUSY,
+            0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE
+        )) {
+            break;
+        }
+    }
+
+    select = (struct _green_select *)state;
+    woke = __atomic_compare_exchange_n(
+        &select->winner, &none, event,
+        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+    );
+    if (woke)
+        _select_wake(select);
+
+    // If another event won, this one stays set for next time
+    __atomic_store_n(
+        &event->state, woke ? _EVENT_IDLE : _EVENT_SET, __ATOMIC_RELEASE
+    );
+    return woke;
+}
+
+int green_event_clear(struct green_event *event)
+{
+    uintptr_t state = _EVENT_SET;
+    return __atomic_compare_exchange_n(
+        &event->state, &state, _EVENT_IDLE,
+        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED
+    );
+}
+
+/* Take an event back from a select, waiting out green_event_set. */
+static void _select_unregister(struct green_event *event, struct _green_select *select)
+{
+    uintptr_t state = (uintptr_t)select;
+
+    while (!__atomic_compare_exchange_n(
+        &event->state, &state, _EVENT_IDLE,
+        0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE
+    )) {
+        if (state != _EVENT_BUSY)
+            return;
+        sched_yield();
+        state = (uintptr_t)select;
+    }
+}
+
+// Runs if the selecting coroutine is cancelled while it waits
+static void _select_cancel(void *arg)
+{
+    struct _green_select *select = arg;
+    size_t i;
+
+    for (i = 0; i < select->n_registered; i += 1)
+        _select_unregister(select->events[i], select);
+
+    // Nobody is left to consume the winner, so leave it set
+    if (select->winner != NULL)
+        green_event_set(select->winner);
+}
+
+int green_select(struct green_event *const *events, size_t n_events)
+{
+    struct _green_select select = {
+        NULL, green_sched_self(), *_green_current(), events, 0
+    };
+    struct green_event *none = NULL;
+    struct green_cleanup cleanup;
+    uintptr_t state;
+    size_t n_registered, i;
+    struct _green_task *task;
+    int busy = 0, won = 0, result = -1;
+
+    if (select.thread == NULL || select.sched == NULL) {
+        errno = EPERM;
+        return -1;
+    } else if (n_events == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    green_cleanup_push(&cleanup, _select_cancel, &select);
+    for (n_registered = 0; n_registered < n_events; n_registered += 1) {
+        struct green_event *event = events[n_registered];
+        state = _EVENT_IDLE;
+        if (__atomic_compare_exchange_n(
+            &event->state, &state, (uintptr_t)&select,
+            0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+        )) {
+            select.n_registered = n_registered + 1;
+            continue;
+        }
+
+        if (state == _EVENT_SET && green_event_clear(event)) {
+            won = __atomic_compare_exchange_n(
+                &select.winner, &none, event,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+            );
+            if (won)
+                break;
+            // Lost to an event registered earlier, so put this one back
+            green_event_set(event);
+            break;
+        }
+
+        // Events can only be waited on by one select at a time
+        if (state != _EVENT_SET && state != _EVENT_IDLE) {
+            busy = 1;
+            break;
+        }
+
+        // The event changed under us; try it again
+        n_registered -= 1;
+    }
+
+    if (n_registered == n_events) {
+        while (__atomic_load_n(&select.winner, __ATOMIC_ACQUIRE) == NULL)
+            green_sched_park();
+    }
+
+    for (i = 0; i < n_registered; i += 1)
+        _select_unregister(events[i], &select);
+    green_cleanup_pop(0);
+
+    // A setter that won has made this coroutine ready exactly once,
+    // and that wake may not be the one that got it here
+    // (it may not have parked yet, or been woken by something else);
+    // take it now, so it cannot resume some later park instead.
+    // The setters are done with it, and only this pthread dequeues it.
+    task = &_EXT(select.thread)->task;
+    while (task->queued
+           || __atomic_load_n(&task->remote, __ATOMIC_ACQUIRE) == _REMOTE_PENDING)
+        green_sched_park();
+
+    if (busy) {
+        if (select.winner != NULL)
+            green_event_set(select.winner);
+        errno = EBUSY;
+        return -1;
+    }
+
+    for (i = 0; i < n_events; i += 1) {
+        if (events[i] == select.winner) {
+            result = (int)i;
+            break;
+        }
+    }
+
+    return result;
+}
+
+
+void green_future_init(struct green_future *future)
+{
+    green_event_init(&future->event);
+    future->value = NULL;
+    future->claimed = 0;
+    future->ready = 0;
+}
+
+int green_future_set(struct green_future *future, green_resume_t value)
+{
+    if (__atomic_exchange_n(&future->claimed, 1, __ATOMIC_ACQUIRE)) {
+        errno = EALREADY;
+        return -1;
+    }
+
+    future->value = value;
+    __atomic_store_n(&future->ready, 1, __ATOMIC_RELEASE);
+    green_event_set(&future->event);
+    return 0;
+}
+
+int green_future_ready(const struct green_future *future)
+{
+    return __atomic_load_n(&future->ready, __ATOMIC_ACQUIRE);
+}
+
+green_resume_t green_future_get(struct green_future *future)
+{
+    struct green_event *event = &future->event;
+
+    while (!green_future_ready(future)) {
+        if (green_select(&event, 1) < 0)
+            return GREEN_AWAIT_FAILED;
+    }
+
+    return future->value;
+}
+
+
+/*
+ * The watchdog samples each attached pthread's switch count
+ * (bumped by every green_resume) and current coroutine.
+ * If a coroutine stays current without a single switch for too long,
+ * the pthread is sent GREEN_WATCHDOG_SIGNAL,
+ * whose handler records where that coroutine has got to.
+ * Sampling from the pthread itself means the watchdog never has to
+ * read the header of a coroutine that may have just been freed.
+ * The lock is dropped while sampling and reporting,
+ * so a slow report never holds up attaching or detaching;
+ * the worker being sampled is marked so that detaching waits for it.
+ */
+struct _green_worker {
+    struct _green_worker *next;
+    pthread_t pthread;
+    void *context;
+    green_thread_t *active;
+    unsigned long *switches;
+    unsigned long seen;
+    unsigned long long since;
+    int reported;
+    struct green_stall sample;
+    int sampled;
+    int sampling;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t idle;
+    pthread_t pthread;
+    struct _green_worker *workers;
+    unsigned long threshold_us;
+    green_stall_report_t report;
+    void *context;
+    int running;
+    int stop;
+} _watch = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+static __thread struct _green_worker *_watch_self;
+static pthread_key_t _watch_key;
+static pthread_once_t _watch_once = PTHREAD_ONCE_INIT;
+
+#define _WATCH_SAMPLE_WAIT  10000   // microseconds
+
+/*
+ * Values of _green_worker::sampled.
+ * The handler only writes the sample if it can claim a wanted one,
+ * so a signal that arrives after the watchdog gave up on it
+ * cannot write over the next request or report.
+ */
+#define _SAMPLE_IDLE        0
+#define _SAMPLE_WANTED      1
+#define _SAMPLE_WRITING     2
+#define _SAMPLE_DONE        3
+
+static void _watch_handler(int signo, siginfo_t *info, void *context)
+{
+    struct _green_worker *worker = _watch_self;
+    ucontext_t *uc = context;
+    green_thread_t thread = _green_active;
+
+    int wanted = _SAMPLE_WANTED;
+
+    (void)signo;
+    (void)info;
+    if (worker == NULL || !__atomic_compare_exchange_n(
+        &worker->sampled, &wanted, _SAMPLE_WRITING,
+        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED
+    ))
+        return;
+
+    worker->sample.thread = thread;
+    worker->sample.start = thread == NULL ? NULL : _HEADER(thread)->start;
+#if A_LX64
+    worker->sample.sp = (void *)uc->uc_mcontext.gregs[REG_RSP];
+    worker->sample.pc = (void *)uc->uc_mcontext.gregs[REG_RIP];
+#elif A_ARM64
+    worker->sample.sp = (void *)uc->uc_mcontext.sp;
+    worker->sample.pc = (void *)uc->uc_mcontext.pc;
+#else
+    (void)uc;
+#endif
+    __atomic_store_n(&worker->sampled, _SAMPLE_DONE, __ATOMIC_RELEASE);
+}
+
+static void _watch_sample(struct _green_worker *worker, green_thread_t active)
+{
+    struct timespec pause = { 0, 100000 };
+    int waited, wanted = _SAMPLE_WANTED;
+
+    memset(&worker->sample, 0, sizeof(worker->sample));
+    __atomic_store_n(&worker->sampled, _SAMPLE_WANTED, __ATOMIC_RELEASE);
+    if (pthread_kill(worker->pthread, GREEN_WATCHDOG_SIGNAL) == 0) {
+        for (waited = 0; waited < _WATCH_SAMPLE_WAIT; waited += 100) {
+            if (__atomic_load_n(&worker->sampled, __ATOMIC_ACQUIRE) == _SAMPLE_DONE)
+                return;
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    // Withdraw the request, unless the handler has just claimed it
+    if (!__atomic_compare_exchange_n(
+        &worker->sampled, &wanted, _SAMPLE_IDLE,
+        0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE
+    )) {
+        while (__atomic_load_n(&worker->sampled, __ATOMIC_ACQUIRE) != _SAMPLE_DONE)
+            sched_yield();
+        return;
+    }
+
+    // The pthread never answered; at least say which coroutine it was
+    worker->sample.thread = active;
+}
+
+/*
+ * Returns how long (in nanoseconds) the worker has been stalled
+ * if that needs reporting, otherwise 0.
+ */
+static unsigned long long _watch_check(
+    struct _green_worker *worker, unsigned long long now, green_thread_t *active
+) {
+    unsigned long switches = __atomic_load_n(worker->switches, __ATOMIC_RELAXED);
+    unsigned long long stalled = now - worker->since;
+
+    *active = __atomic_load_n(worker->active, __ATOMIC_RELAXED);
+    if (switches != worker->seen || *active == NULL) {
+        worker->seen = switches;
+        worker->since = now;
+        worker->reported = 0;
+        return 0;
+    }
+
+    if (worker->reported || stalled < (unsigned long long)_watch.threshold_us * 1000)
+        return 0;
+
+    worker->reported = 1;
+    return stalled;
+}
+
+// Sample and report a stalled worker (called without the lock)
+static void _watch_report(
+    struct _green_worker *worker, green_thread_t active, unsigned long long stalled
+) {
+    struct green_stall stall;
+
+    _watch_sample(worker, active);
+    stall = worker->sample;
+    stall.worker = worker->context;
+    stall.stalled_us = stalled / 1000;
+    _watch.report(&stall, _watch.context);
+}
+
+static void *_watch_run(void *arguments)
+{
+    unsigned long long now, stalled, period = (unsigned long long)_watch.threshold_us * 250;
+    struct _green_worker *worker;
+    green_thread_t active;
+    struct timespec until;
+
+    (void)arguments;
+    pthread_mutex_lock(&_watch.lock);
+    while (!_watch.stop) {
+        now = _clock_now();
+        for (worker = _watch.workers; worker != NULL; worker = worker->next) {
+            if ((stalled = _watch_check(worker, now, &active)) == 0)
+                continue;
+
+            worker->sampling = 1;
+            pthread_mutex_unlock(&_watch.lock);
+            _watch_report(worker, active, stalled);
+            pthread_mutex_lock(&_watch.lock);
+            worker->sampling = 0;
+            pthread_cond_broadcast(&_watch.idle);
+        }
+
+        now += period;
+        until.tv_sec = now / 1000000000;
+        until.tv_nsec = now % 1000000000;
+        while (!_watch.stop
+               && pthread_cond_timedwait(&_watch.cond, &_watch.lock, &until) == 0) {}
+    }
+    pthread_mutex_unlock(&_watch.lock);
+
+    return NULL;
+}
+
+static void _watch_forget(struct _green_worker *worker)
+{
+    struct _green_worker **link;
+
+    pthread_mutex_lock(&_watch.lock);
+
+    // The watchdog carries on from this worker's next once it is done
+    while (worker->sampling)
+        pthread_cond_wait(&_watch.idle, &_watch.lock);
+
+    for (link = &_watch.workers; *link != NULL; link = &(*link)->next) {
+        if (*link == worker) {
+            *link = worker->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_watch.lock);
+
+    free(worker);
+}
+
+/*
+ * Pthreads that exit while attached are detached on the way out.
+ * _watch_self goes first, so a sample signal that arrives late
+ * has nowhere to write.
+ */
+static void _watch_exit(void *worker)
+{
+    _watch_self = NULL;
+    _watch_forget(worker);
+    _altstack_release();
+}
+
+static void _watch_init(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_key_create(&_watch_key, _watch_exit);
+
+    // Timed waits are against CLOCK_MONOTONIC, like everything else here
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_destroy(&_watch.cond);
+    pthread_cond_init(&_watch.cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+int green_watchdog_start(
+    unsigned long threshold_us,
+    green_stall_report_t report,
+    void *context
+) {
+    struct sigaction action = { 0 };
+    struct _green_worker *worker;
+    int error;
+
+    if (threshold_us == 0 || report == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_once(&_watch_once, _watch_init);
+    action.sa_sigaction = _watch_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(GREEN_WATCHDOG_SIGNAL, &action, NULL) != 0)
+        return -1;
+
+    pthread_mutex_lock(&_watch.lock);
+    if (_watch.running) {
+        pthread_mutex_unlock(&_watch.lock);
+        errno = EALREADY;
+        return -1;
+    }
+
+    for (worker = _watch.workers; worker != NULL; worker = worker->next) {
+        worker->since = _clock_now();
+        worker->reported = 0;
+    }
+
+    _watch.threshold_us = threshold_us;
+    _watch.report = report;
+    _watch.context = context;
+    _watch.stop = 0;
+    error = pthread_create(&_watch.pthread, NULL, _watch_run, NULL);
+    _watch.running = error == 0;
+    pthread_mutex_unlock(&_watch.lock);
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+void green_watchdog_stop(void)
+{
+    pthread_mutex_lock(&_watch.lock);
+
+    // Someone else is already stopping it; wait for them to finish
+    if (_watch.running && _watch.stop) {
+        while (_watch.running)
+            pthread_cond_wait(&_watch.idle, &_watch.lock);
+    }
+    if (!_watch.running) {
+        pthread_mutex_unlock(&_watch.lock);
+        return;
+    }
+
+    _watch.stop = 1;
+    pthread_cond_signal(&_watch.cond);
+    pthread_mutex_unlock(&_watch.lock);
+
+    pthread_join(_watch.pthread, NULL);
+
+    pthread_mutex_lock(&_watch.lock);
+    _watch.running = 0;
+    pthread_cond_broadcast(&_watch.idle);
+    pthread_mutex_unlock(&_watch.lock);
+}
+
+int green_watchdog_attach(void *worker_context)
+{
+    struct _green_worker *worker;
+
+    if (_watch_self != NULL) {
+        errno = EALREADY;
+        return -1;
+    }
+
+    pthread_once(&_watch_once, _watch_init);
+    if (_altstack_acquire() != 0)
+        return -1;
+    if ((worker = calloc(1, sizeof(*worker))) == NULL) {
+        _altstack_release();
+        return -1;
+    }
+
+    worker->pthread = pthread_self();
+    worker->context = worker_context;
+    worker->active = &_green_active;
+    worker->switches = &_green_switches;
+    worker->seen = _green_switches;
+    worker->since = _clock_now();
+    _watch_self = worker;
+    pthread_setspecific(_watch_key, worker);
+
+    pthread_mutex_lock(&_watch.lock);
+    worker->next = _watch.workers;
+    _watch.workers = worker;
+    pthread_mutex_unlock(&_watch.lock);
+
+    return 0;
+}
+
+void green_watchdog_detach(void)
+{
+    struct _green_worker *worker = _watch_self;
+
+    if (worker == NULL)
+        return;
+
+    pthread_setspecific(_watch_key, NULL);
+    _watch_exit(worker);
 }
@@ -30,6 +30,11 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
 
 /** \file
  * The green API is fairly simple:
@@ -47,6 +52,11 @@
  * you can define your own system for handling
  * when and why these switches happen.
  *
+ * A few optional helpers are built on top of that
+ * (such as \ref green_cancel, coroutine-local slots
+ *  and batching generators),
+ * but none of them are needed to use the core API.
+ *
  * You are encouraged to read the detailed documentation
  * for the full API (there's not much of it),
  * but here's a short version:
@@ -104,7 +114,8 @@ typedef struct gaio_resume *green_resume_t;
  * It is needed to resume a coroutine.
  *
  * The resources associated with a coroutine are released
- * once the associated `start` function returns.
+ * once the associated `start` function returns,
+ * or once it is cancelled (see \ref green_cancel).
  */
 typedef struct _green_thread *green_thread_t;
 
@@ -129,6 +140,8 @@ typedef void (*green_start_t)(void *arguments);
  *                      and may be dynamic if the system supports it.
  *                      The stack will never start smaller than this value.
  *                      If zero, a sensible default will be used instead (16K).
+ *                      Sizes up to \ref GREEN_STACK_MAX are rounded up
+ *                      to a power of two (see \ref green_stack_stats).
  * \returns
  *  The handle to the newly-created coroutine.
  *  If sufficient resources cannot be allocated,
@@ -136,9 +149,32 @@ typedef void (*green_start_t)(void *arguments);
  *  and the system's error code mechanism
  *  may contain more information
  *  (for Linux, see `mmap(3)`).
+ *  If a limit set with \ref green_mem_limit has been reached,
+ *  the error is `EAGAIN`.
  */
 green_thread_t green_spawn(green_start_t start, void *arguments, size_t hint);
 
+/**
+ * Reserve space for a new coroutine's arguments on its own stack.
+ *
+ * The space sits at the top of the coroutine's stack,
+ * just below its header,
+ * and replaces `arguments` as the value passed to `start`.
+ * Copying arguments there means nothing else has to keep them alive,
+ * and nothing has to be allocated for them.
+ * The space is freed along with the rest of the coroutine.
+ *
+ * \param[in] thread A coroutine that has not been resumed yet.
+ * \param[in] size   How many bytes to reserve.
+ *                   The space is aligned to 16 bytes.
+ * \returns
+ *  The space.
+ *  Otherwise, returns `NULL` and sets `errno`
+ *  (`EALREADY` if the coroutine has already started;
+ *   or `ENOMEM` if `size` is more than half the stack).
+ */
+void *green_spawn_args(green_thread_t thread, size_t size);
+
 /**
  * Run the coroutine until it needs to wait for something.
  *
@@ -186,15 +222,13 @@ green_await_t green_resume(green_thread_t thread, green_resume_t resume_with);
  * \ref green_resume has been called with this thread,
  * and the value passed to `resume_with` is returned from this function.
  *
- * Do not call this function with a `wait_for` of `NULL`,
- * as this value is used to signal to the caller of \ref green_resume
- * that the coroutine has finished and is all cleaned up.
- * If you pass `NULL`,
- * this coroutine will never be resumed
- * and the allocated resources will be leaked.
- * The special value of `NULL` may be used in the future
- * to cause this coroutine to destructively stop early,
- * however this is currently not implemented for any platform.
+ * Passing a `wait_for` of `NULL` causes this coroutine
+ * to destructively stop early:
+ * any handlers registered with \ref green_cleanup_push are run,
+ * the coroutine's resources are freed,
+ * and \ref green_resume returns `NULL`
+ * exactly as if `start` had returned.
+ * In that case, this function never returns.
  *
  * \param[in] wait_for The value to be returned from \ref green_resume.
  * \returns
@@ -203,6 +237,1311 @@ green_await_t green_resume(green_thread_t thread, green_resume_t resume_with);
  */
 green_resume_t green_await(green_await_t wait_for);
 
+/**
+ * Get the coroutine running on the calling pthread.
+ *
+ * \returns The coroutine, or `NULL` if called outside of any coroutine.
+ */
+green_thread_t green_self(void);
+
+/**
+ * A coroutine whose stack is not allocated until it is first resumed.
+ *
+ * This holds only what \ref green_spawn needs,
+ * so work that is queued and then dropped before it ever runs
+ * costs this struct rather than a stack.
+ * It is owned by the caller, and can be embedded in its own queues.
+ */
+struct green_deferred {
+    /** The function to spawn. */
+    green_start_t start;
+    /** The argument to pass to `start`. */
+    void *arguments;
+    /** The stack size to pass to \ref green_spawn. */
+    size_t hint;
+    /** The coroutine, while it has a stack. */
+    green_thread_t thread;
+
+    int state;
+};
+
+/**
+ * Prepare a coroutine to be spawned when it is first resumed.
+ *
+ * Nothing is allocated here.
+ * The arguments are the same as for \ref green_spawn.
+ */
+void green_spawn_deferred(
+    struct green_deferred *deferred,
+    green_start_t start,
+    void *arguments,
+    size_t hint
+);
+
+/**
+ * Resume a deferred coroutine, spawning it first if need be.
+ *
+ * This behaves like \ref green_resume.
+ * Only one pthread resumes it at a time, spawning it the first time;
+ * the others get `GREEN_RESUME_FAILED` instead,
+ * so racing first resumes never spawn it twice,
+ * and none of them can resume a stack freed by the one that finished it.
+ * For that to hold, the coroutine must only be resumed (or cancelled)
+ * through its `green_deferred`, never through `thread`.
+ *
+ * \param[in] deferred    The deferred coroutine.
+ * \param[in] resume_with As for \ref green_resume.
+ * \returns
+ *  As for \ref green_resume.
+ *  Also returns `GREEN_RESUME_FAILED` if the stack could not be allocated
+ *  (with `errno` set as by \ref green_spawn),
+ *  if the coroutine is already being resumed
+ *  (with `errno` set to `EBUSY`),
+ *  or if it has already finished or been cancelled
+ *  (with `errno` set to `ESRCH`).
+ */
+green_await_t green_deferred_resume(
+    struct green_deferred *deferred,
+    green_resume_t resume_with
+);
+
+/**
+ * Destroy a deferred coroutine that is not running.
+ *
+ * If it has never been resumed, there is nothing to free.
+ * Otherwise, this is \ref green_cancel.
+ * Either way, it cannot be resumed again.
+ * Cancelling one that has already finished does nothing.
+ *
+ * \param[in] deferred The deferred coroutine.
+ * \returns
+ *  Zero on success.
+ *  Otherwise, returns `-1` and sets `errno` to `EBUSY`
+ *  (the coroutine is being resumed, or \ref green_cancel refused it).
+ */
+int green_deferred_cancel(struct green_deferred *deferred);
+
+/** Smallest stack \ref green_spawn hands out. */
+#define GREEN_STACK_MIN         0x1000
+/** Largest stack \ref green_spawn hands out from a size class. */
+#define GREEN_STACK_MAX         0x100000
+/** Number of stack size classes (powers of two, min to max). */
+#define GREEN_STACK_CLASSES     9
+
+/**
+ * Statistics for one stack size class.
+ *
+ * Stacks up to \ref GREEN_STACK_MAX are rounded up to a power of two
+ * and taken from slabs of 64 stacks of that size,
+ * which are kept (and reused) for the life of the process.
+ * Larger stacks are mapped individually.
+ *
+ * Stacks of 16 pages or more give up their lowest page as a guard,
+ * so overflowing one faults instead of corrupting the stack below it;
+ * smaller stacks are packed with no gap between them.
+ */
+struct green_stack_stats {
+    /** Size of each stack in this class. */
+    size_t size;
+    /** Slabs mapped for this class. */
+    size_t slabs;
+    /** Stacks currently in use. */
+    size_t in_use;
+    /** Most stacks ever in use at once. */
+    size_t peak;
+    /** Stacks handed out in total. */
+    unsigned long long allocs;
+};
+
+/**
+ * Get statistics for each stack size class, smallest first.
+ *
+ * \param[out] stats Where to store the statistics.
+ * \param[in]  n     How many classes there is room for.
+ * \returns How many classes were filled in.
+ */
+int green_stack_stats(struct green_stack_stats *stats, size_t n);
+
+/**
+ * How much stack memory coroutines are using.
+ *
+ * Reserved bytes are address space mapped for stacks,
+ * including slab space no coroutine holds yet;
+ * committed bytes are the full size (class) of the stacks
+ * handed to live coroutines.
+ * Neither is resident memory:
+ * pages of a stack only take up memory once they are touched,
+ * and a freed slab stack keeps its touched pages for its next user
+ * rather than handing them back to the kernel,
+ * so the process's resident size does not shrink
+ * when coroutines are released.
+ */
+struct green_mem_stats {
+    /** Coroutines spawned and not yet released. */
+    size_t live;
+    /** Bytes of stack mapped. */
+    size_t reserved;
+    /** Bytes of stack held by live coroutines. */
+    size_t committed;
+};
+
+/**
+ * Get memory statistics for every coroutine in the process.
+ *
+ * \param[out] stats Where to store the statistics.
+ */
+void green_mem_stats(struct green_mem_stats *stats);
+
+/**
+ * Get memory statistics for the coroutines spawned by this pthread.
+ *
+ * Coroutines count against the pthread that spawned them
+ * wherever they end up being released,
+ * and slabs against the pthread whose spawn mapped them.
+ *
+ * \param[out] stats Where to store the statistics.
+ */
+void green_mem_stats_self(struct green_mem_stats *stats);
+
+/**
+ * Limit how many coroutines may be alive at once,
+ * and how many bytes of stack they may hold between them.
+ *
+ * Once either limit would be exceeded,
+ * \ref green_spawn fails with `EAGAIN`
+ * (rather than `ENOMEM`, which means the system itself is out)
+ * until enough coroutines have been released.
+ * Coroutines already alive are not affected by lowering a limit.
+ *
+ * \param[in] max_live      Most coroutines alive at once, or 0 for no limit.
+ * \param[in] max_committed Most bytes held by live coroutines, or 0 for no limit.
+ */
+void green_mem_limit(size_t max_live, size_t max_committed);
+
+/**
+ * Resume several coroutines, one after the other.
+ *
+ * This behaves like calling \ref green_resume on each in turn,
+ * but prefetches each coroutine's header and saved stack
+ * while the one before it runs.
+ *
+ * \param[in]  threads The coroutines to resume.
+ * \param[in]  values  The value to resume each with,
+ *                     or `NULL` to resume them all with `NULL`.
+ * \param[in]  n       How many coroutines there are.
+ * \param[out] out     Where to store what each \ref green_resume returned,
+ *                     or `NULL` if that is not needed.
+ * \returns
+ *  How many of the coroutines were resumed
+ *  (that is, did not return `GREEN_RESUME_FAILED`).
+ */
+size_t green_resume_many(
+    const green_thread_t *threads,
+    const green_resume_t *values,
+    size_t n,
+    green_await_t *out
+);
+
+
+/**
+ * Bind a coroutine's stack to a NUMA node.
+ *
+ * Stack pages that have already been touched
+ * are migrated to `node`,
+ * and any pages touched later will be allocated there.
+ * Call this straight after \ref green_spawn
+ * to place a new stack near the pthread that will run it,
+ * or on a parked coroutine when it is moved
+ * to a pthread on another node.
+ *
+ * The coroutine must not be running
+ * (i.e. it must be able to be passed to \ref green_resume).
+ * The binding is dropped when the coroutine is released.
+ *
+ * \param[in] thread Handle to the coroutine to bind.
+ * \param[in] node   The NUMA node to bind the stack to.
+ *                   If negative, the node of the CPU
+ *                   the calling pthread is currently running on
+ *                   is used instead.
+ * \returns
+ *  Zero on success.
+ *  Otherwise, returns `-1` and sets `errno`
+ *  (`EBUSY` if the coroutine is currently running;
+ *   for other values, see `mbind(2)`).
+ */
+int green_bind(green_thread_t thread, int node);
+
+
+/**
+ * Destroy a coroutine that is not running.
+ *
+ * This releases the coroutine's stack immediately,
+ * without resuming it through any of its remaining awaits.
+ * Any handlers registered with \ref green_cleanup_push
+ * are run first (most recent first),
+ * on the stack of the caller of this function.
+ *
+ * The handle must not be used again after this succeeds.
+ * A coroutine can stop itself with `green_await(NULL)`.
+ *
+ * \param[in] thread Handle to the coroutine to destroy.
+ * \returns
+ *  Zero on success.
+ *  Otherwise, returns `-1` and sets `errno` to `EBUSY`
+ *  (the coroutine is currently running,
+ *   or is waiting in \ref green_offload).
+ */
+int green_cancel(green_thread_t thread);
+
+/**
+ * A cleanup handler registration.
+ *
+ * These are intended to be allocated on the coroutine's own stack,
+ * in the frame that calls \ref green_cleanup_push.
+ */
+struct green_cleanup {
+    void (*routine)(void *arg);
+    void *arg;
+    struct green_cleanup *next;
+};
+
+/**
+ * Register a handler to be run if the current coroutine is destroyed.
+ *
+ * Handlers are run when the coroutine is cancelled
+ * (by \ref green_cancel or `green_await(NULL)`).
+ * Much like `pthread_cleanup_push(3)`,
+ * every push must be matched by a \ref green_cleanup_pop
+ * in the same function.
+ * Handlers must not call \ref green_await,
+ * since they may be run from outside the coroutine.
+ *
+ * Does nothing if called outside of any coroutine.
+ *
+ * \param[out] cleanup Storage for the registration.
+ * \param[in]  routine The handler.
+ * \param[in]  arg     A value to be passed straight through to `routine`.
+ */
+void green_cleanup_push(
+    struct green_cleanup *cleanup,
+    void (*routine)(void *arg),
+    void *arg
+);
+
+/**
+ * Remove the most recently pushed cleanup handler.
+ *
+ * \param[in] execute If non-zero, the handler is run as well.
+ */
+void green_cleanup_pop(int execute);
+
+
+/** Number of coroutine-local slots available in each coroutine. */
+#define GREEN_LOCALS    8
+
+/**
+ * Reserve a coroutine-local slot.
+ *
+ * Slots are never given back,
+ * so keys should be reserved once at startup
+ * (much like `pthread_key_create(3)`).
+ *
+ * \returns
+ *  A key for use with \ref green_local_get and \ref green_local_set.
+ *  If all \ref GREEN_LOCALS slots have been reserved,
+ *  returns `-1` and sets `errno` to `EAGAIN`.
+ */
+int green_local_key(void);
+
+/**
+ * Get the value of a coroutine-local slot.
+ *
+ * Every coroutine starts with all of its slots set to `NULL`.
+ * Outside of any coroutine,
+ * a separate set of slots belonging to the calling pthread is used.
+ *
+ * \param[in] key A key returned by \ref green_local_key.
+ * \returns The value last set for `key` in the current coroutine.
+ */
+void *green_local_get(int key);
+
+/**
+ * Set the value of a coroutine-local slot.
+ *
+ * \param[in] key   A key returned by \ref green_local_key.
+ * \param[in] value The new value for `key` in the current coroutine.
+ */
+void green_local_set(int key, void *value);
+
+
+/**
+ * A batching generator.
+ *
+ * The producer coroutine writes items into a buffer
+ * provided by the consumer,
+ * and only switches back to the consumer once that buffer is full
+ * (or the producer flushes it early).
+ * This costs one switch per batch of `capacity` items,
+ * rather than one per item.
+ *
+ * The generator uses its own pointer as the value
+ * passed through \ref green_await and \ref green_resume,
+ * so the producer must not await anything else
+ * while running as a generator.
+ *
+ * The consumer should fill in the first four fields,
+ * then call \ref green_gen_start.
+ * The remaining fields are private.
+ */
+struct green_gen {
+    /** Storage for `capacity` items of `item_size` bytes. */
+    void *buffer;
+    /** The size of each item. */
+    size_t item_size;
+    /** The number of items that fit in `buffer`. */
+    size_t capacity;
+    /** A value for the producer to use however it sees fit. */
+    void *arguments;
+
+    green_thread_t thread;
+    size_t count;
+    size_t next;
+    int done;
+};
+
+/**
+ * Spawn the producer for a generator.
+ *
+ * `producer` is called with `gen` as its argument,
+ * and should call \ref green_gen_yield for each item.
+ * Returning from `producer` ends the generator.
+ *
+ * \param[in,out] gen      The generator.
+ * \param[in]     producer The entrypoint of the producer.
+ * \param[in]     hint     The stack size hint (see \ref green_spawn).
+ * \returns
+ *  Zero on success.
+ *  Otherwise, returns `-1` and sets `errno` (see \ref green_spawn).
+ */
+int green_gen_start(struct green_gen *gen, green_start_t producer, size_t hint);
+
+/**
+ * Produce an item (called from the producer).
+ *
+ * The item is copied into the consumer's buffer.
+ * If that fills the buffer,
+ * the producer is paused until the consumer wants more.
+ *
+ * \param[in,out] gen  The generator.
+ * \param[in]     item `item_size` bytes to copy into the buffer.
+ * \returns
+ *  Zero on success.
+ *  If called outside of any coroutine,
+ *  returns `-1` and sets `errno` to `EPERM`
+ *  (the item is kept if there was room for it).
+ *  If the buffer is still full because of such a failure,
+ *  returns `-1` and sets `errno` to `ENOBUFS`.
+ */
+int green_gen_yield(struct green_gen *gen, const void *item);
+
+/**
+ * Hand over any buffered items now (called from the producer).
+ *
+ * Does nothing if no items are buffered.
+ *
+ * \param[in,out] gen The generator.
+ * \returns As for \ref green_gen_yield.
+ */
+int green_gen_flush(struct green_gen *gen);
+
+/**
+ * Make sure there are items ready to be consumed.
+ *
+ * If every buffered item has been consumed,
+ * the producer is resumed until it fills the buffer again.
+ *
+ * \param[in,out] gen The generator.
+ * \returns
+ *  The number of buffered items not yet consumed.
+ *  These start at `buffer[gen->next]`.
+ *  Zero means the producer has finished
+ *  (or, with `errno` set to `EPROTO`,
+ *   that the producer awaited something else).
+ */
+size_t green_gen_fill(struct green_gen *gen);
+
+/**
+ * Take the next item from a generator.
+ *
+ * \param[in,out] gen The generator.
+ * \returns
+ *  A pointer to the item within the buffer,
+ *  valid until the next call to \ref green_gen_next
+ *  or \ref green_gen_fill;
+ *  or `NULL` once the producer has finished
+ *  (see \ref green_gen_fill).
+ */
+void *green_gen_next(struct green_gen *gen);
+
+/**
+ * Stop a generator early.
+ *
+ * If the producer has not finished, it is cancelled
+ * (see \ref green_cancel).
+ *
+ * \param[in,out] gen The generator.
+ */
+void green_gen_close(struct green_gen *gen);
+
+
+/**
+ * A pool of helper pthreads for running blocking calls.
+ *
+ * See \ref green_offload.
+ */
+struct green_offload_pool;
+
+/**
+ * Where coroutines are handed back once their offloaded job is done.
+ *
+ * There should be one of these for each pthread
+ * that runs coroutines calling \ref green_offload,
+ * and it must only be polled by that pthread.
+ * Only `fd` is public.
+ */
+struct green_offload_queue {
+    /**
+     * An eventfd that becomes readable
+     * when coroutines are ready to be resumed.
+     * Add this to your event loop,
+     * and call \ref green_offload_poll when it fires.
+     */
+    int fd;
+
+    struct _green_offload *done;
+    struct _green_offload *ready;
+};
+
+/**
+ * Start a pool of helper pthreads.
+ *
+ * \param[in] n_threads The number of helper pthreads.
+ * \returns
+ *  The new pool,
+ *  or `NULL` with `errno` set if it could not be created.
+ */
+struct green_offload_pool *green_offload_pool_create(size_t n_threads);
+
+/**
+ * Stop a pool of helper pthreads.
+ *
+ * Any jobs already submitted are finished first.
+ *
+ * \param[in] pool The pool to destroy.
+ */
+void green_offload_pool_destroy(struct green_offload_pool *pool);
+
+/**
+ * Prepare a queue for coroutines returning from offloaded jobs.
+ *
+ * \param[out] queue The queue.
+ * \returns
+ *  Zero on success.
+ *  Otherwise, returns `-1` and sets `errno` (see `eventfd(2)`).
+ */
+int green_offload_queue_init(struct green_offload_queue *queue);
+
+/** Release the resources held by a queue. */
+void green_offload_queue_destroy(struct green_offload_queue *queue);
+
+/**
+ * Run a blocking function on a helper pthread.
+ *
+ * The current coroutine submits `func(arg)` to `pool`,
+ * then awaits \ref GREEN_OFFLOADED.
+ * When the caller of \ref green_resume sees that value,
+ * it should leave the coroutine alone
+ * until \ref green_offload_poll hands it back via `queue`,
+ * and then resume it (with any value).
+ * This function then returns.
+ * Until then, \ref green_cancel refuses the coroutine,
+ * since the job is still in use.
+ *
+ * If called outside of any coroutine,
+ * `func(arg)` is simply called directly.
+ *
+ * \param[in] pool  The helper pool to run `func` on.
+ * \param[in] queue The queue of the pthread running this coroutine.
+ * \param[in] func  The function to run.
+ * \param[in] arg   A value to be passed straight through to `func`.
+ * \returns
+ *  Zero once `func` has returned.
+ *  If the pool is being destroyed,
+ *  returns `-1` and sets `errno` to `ECANCELED`.
+ */
+int green_offload(
+    struct green_offload_pool *pool,
+    struct green_offload_queue *queue,
+    void (*func)(void *arg),
+    void *arg
+);
+
+/**
+ * Take the next coroutine whose offloaded job has finished.
+ *
+ * Never blocks.
+ * Must be called from the pthread that owns `queue`.
+ *
+ * \param[in,out] queue The queue.
+ * \returns
+ *  A coroutine to resume,
+ *  or `NULL` if none are ready.
+ */
+green_thread_t green_offload_poll(struct green_offload_queue *queue);
+
+/** Special value awaited by \ref green_offload. */
+#define GREEN_OFFLOADED         ((green_await_t)&green_offload)
+
+
+/**
+ * A function that waits for file descriptors, in the style of `poll(2)`.
+ *
+ * When installed with \ref green_set_poll,
+ * this is called from within a coroutine,
+ * and should register `fds` with your event loop
+ * and then \ref green_await until one of them is ready
+ * or `timeout` milliseconds have passed
+ * (a negative timeout means forever).
+ * It should fill in `revents` and return
+ * exactly as `poll(2)` would.
+ * `nfds` may be zero, in which case this is simply a sleep.
+ */
+typedef int (*green_poll_t)(struct pollfd *fds, nfds_t nfds, int timeout);
+
+/**
+ * Set how coroutines on the calling pthread wait for I/O.
+ *
+ * \param[in] hook The new hook, or `NULL` to block in `poll(2)`.
+ * \returns The previous hook.
+ */
+green_poll_t green_set_poll(green_poll_t hook);
+
+/**
+ * Get the hook coroutines should use to wait for I/O.
+ *
+ * \returns
+ *  The hook installed with \ref green_set_poll,
+ *  or `NULL` if there is none
+ *  or this is called outside of any coroutine.
+ */
+green_poll_t green_get_poll(void);
+
+/**
+ * Wait for file descriptors without blocking other coroutines.
+ *
+ * Inside a coroutine, this calls the hook from \ref green_set_poll.
+ * Otherwise (or if there is no hook), this just calls `poll(2)`.
+ */
+int green_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+
+/**
+ * Copy data from a file to a socket without blocking other coroutines.
+ *
+ * Data is moved inside the kernel with `sendfile(2)`,
+ * so it never passes through the coroutine's stack.
+ * Whenever `out_fd` is full,
+ * this waits for it through \ref green_poll.
+ * For this to help, `out_fd` should be non-blocking.
+ *
+ * \param[in]     out_fd The descriptor to write to.
+ * \param[in]     in_fd  The descriptor to read from.
+ * \param[in,out] offset As for `sendfile(2)`.
+ * \param[in]     count  The number of bytes to copy.
+ * \returns
+ *  The number of bytes copied
+ *  (less than `count` only at end of file or after an error).
+ *  If nothing could be copied because of an error,
+ *  returns `-1` and sets `errno` (see `sendfile(2)`).
+ */
+ssize_t green_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+/**
+ * Move data between descriptors without blocking other coroutines.
+ *
+ * This is `splice(2)` (one side must be a pipe),
+ * retried and waited on through \ref green_poll
+ * until `count` bytes have been moved.
+ * `SPLICE_F_NONBLOCK` is always added to `flags`.
+ * If both sides are ready but nothing can be moved,
+ * it waits for a millisecond (again through \ref green_poll)
+ * rather than spinning.
+ * The offsets are `int64_t` (the type of `loff_t`)
+ * so that this header does not need `_GNU_SOURCE`.
+ *
+ * \returns As for \ref green_sendfile.
+ */
+ssize_t green_splice(
+    int in_fd, int64_t *in_offset,
+    int out_fd, int64_t *out_offset,
+    size_t count, unsigned flags
+);
+
+
+#ifndef GREEN_MIGRATE_THRESHOLD
+ /** Default for `green_sched::migrate_threshold`. */
+ #define GREEN_MIGRATE_THRESHOLD    4
+#endif
+
+#ifndef GREEN_SPIN_LIMIT
+ /** Default for `green_sched::spin_limit`. */
+ #define GREEN_SPIN_LIMIT           4096
+#endif
+
+/** Counters describing how a scheduler has waited for work. */
+struct green_sched_stats {
+    /** Calls to \ref green_sched_wait that found nothing ready. */
+    unsigned long long waits;
+    /** Waits that found work while spinning. */
+    unsigned long long spin_hits;
+    /** Waits that went to sleep on the futex. */
+    unsigned long long sleeps;
+    /** Futex wakes other pthreads sent to this scheduler. */
+    unsigned long long wakes;
+    /** Waits that timed out. */
+    unsigned long long timeouts;
+    /** How long the next wait will spin for (see `spin_limit`). */
+    unsigned spin;
+};
+
+/**
+ * A ready queue for coroutines, ordered by priority and deadline.
+ *
+ * Coroutines are run in order of:
+ *
+ * 1. priority (lower values first; see \ref green_sched_priority);
+ * 2. deadline (earliest first, with no deadline last;
+ *    see \ref green_sched_deadline); then
+ * 3. the order in which they were made ready.
+ *
+ * The queue is a pairing heap whose nodes live in each coroutine's
+ * stack header, so queueing never allocates.
+ * A scheduler must only be used from one pthread at a time.
+ *
+ * Only `on_await`, `context`, `migrate_threshold` and `spin_limit`
+ * are public.
+ */
+struct green_sched {
+    /**
+     * Called by \ref green_sched_run when a coroutine awaits
+     * anything other than \ref GREEN_SCHED_YIELD
+     * or \ref GREEN_SCHED_PARK.
+     * If this is `NULL`, such coroutines are left alone.
+     */
+    void (*on_await)(
+        struct green_sched *sched,
+        green_thread_t thread,
+        green_await_t awaited
+    );
+    /** A value for `on_await` to use however it sees fit. */
+    void *context;
+    /**
+     * How many more ready coroutines this scheduler may have
+     * than the least loaded one before \ref green_sched_place
+     * moves coroutines away from it.
+     * Set to \ref GREEN_MIGRATE_THRESHOLD by \ref green_sched_init.
+     */
+    size_t migrate_threshold;
+    /**
+     * The most times \ref green_sched_wait polls for work
+     * before going to sleep.
+     * It adapts within this limit,
+     * spinning for longer while work tends to turn up during the spin.
+     * Zero disables spinning.
+     * Set to \ref GREEN_SPIN_LIMIT by \ref green_sched_init.
+     */
+    unsigned spin_limit;
+
+    struct _green_task *ready;
+    struct _green_task *remote;
+    int sleeping;
+    int woken;
+    unsigned long long seq;
+    size_t n_ready;
+    struct green_sched_stats stats;
+};
+
+/** Prepare an empty scheduler. */
+void green_sched_init(struct green_sched *sched);
+
+/**
+ * Set the priority of a coroutine.
+ *
+ * Takes effect the next time the coroutine is made ready.
+ *
+ * \param[in] thread   The coroutine.
+ * \param[in] priority Lower values run first. Defaults to zero.
+ */
+void green_sched_priority(green_thread_t thread, int priority);
+
+/**
+ * Set the deadline of a coroutine.
+ *
+ * Among coroutines of the same priority,
+ * the one with the earliest deadline runs first.
+ * Takes effect the next time the coroutine is made ready.
+ *
+ * \param[in] thread   The coroutine.
+ * \param[in] deadline An absolute `CLOCK_MONOTONIC` time in nanoseconds,
+ *                     or zero for no deadline (the default).
+ */
+void green_sched_deadline(green_thread_t thread, unsigned long long deadline);
+
+/**
+ * Queue a coroutine to be resumed.
+ *
+ * \param[in] sched  The scheduler.
+ * \param[in] thread The coroutine, which must not be running.
+ * \param[in] value  The value to resume it with.
+ * \returns
+ *  Zero on success.
+ *  If the coroutine is already queued,
+ *  returns `-1` and sets `errno` to `EALREADY`.
+ */
+int green_sched_ready(
+    struct green_sched *sched,
+    green_thread_t thread,
+    green_resume_t value
+);
+
+/**
+ * Make a coroutine ready from a pthread other than the scheduler's.
+ *
+ * The coroutine is pushed onto a lock-free inbox,
+ * which the scheduler drains in one go
+ * the next time it looks for work
+ * (in \ref green_sched_next or \ref green_sched_run).
+ * If the scheduler's pthread is in \ref green_sched_wait, it is woken.
+ * This is safe to call from any pthread, without locking.
+ * A coroutine that finishes or is cancelled while still in the inbox
+ * is not made ready; the drain frees its stack instead.
+ * One that the scheduler's own pthread has made ready in the meantime
+ * keeps its place and value in the queue,
+ * unless that value is `NULL`, in which case it is resumed with `value`.
+ *
+ * \param[in] sched  The scheduler.
+ * \param[in] thread The coroutine. It should not be running,
+ *                   except on the scheduler's own pthread.
+ * \param[in] value  The value to resume it with.
+ * \returns
+ *  Zero on success.
+ *  If the coroutine is already waiting to be queued,
+ *  returns `-1` and sets `errno` to `EALREADY`.
+ */
+int green_sched_ready_remote(
+    struct green_sched *sched,
+    green_thread_t thread,
+    green_resume_t value
+);
+
+/**
+ * Wait until a scheduler has work (called on the scheduler's pthread).
+ *
+ * This returns straight away if coroutines are ready.
+ * Otherwise, it spins for a while (see `spin_limit`),
+ * then sleeps on a futex until another pthread
+ * calls \ref green_sched_ready_remote or \ref green_sched_wake.
+ * Only a scheduler that has actually gone to sleep is sent a futex wake.
+ * A worker pthread typically alternates between this
+ * and \ref green_sched_run.
+ *
+ * \param[in] sched   The scheduler.
+ * \param[in] timeout How long to wait for, or `NULL` to wait indefinitely.
+ * \returns
+ *  Zero once there may be work.
+ *  If the timeout passed first,
+ *  returns `-1` and sets `errno` to `ETIMEDOUT`.
+ */
+int green_sched_wait(struct green_sched *sched, const struct timespec *timeout);
+
+/**
+ * Get a scheduler's waiting statistics.
+ *
+ * \param[in]  sched The scheduler.
+ * \param[out] stats The statistics.
+ */
+void green_sched_stats(const struct green_sched *sched, struct green_sched_stats *stats);
+
+/**
+ * Wake a scheduler's pthread from \ref green_sched_wait,
+ * for example to have it shut down.
+ *
+ * A wake sent while the pthread is not waiting is not lost:
+ * its next \ref green_sched_wait returns straight away instead.
+ * This is safe to call from any pthread.
+ */
+void green_sched_wake(struct green_sched *sched);
+
+/**
+ * Take the next coroutine off the ready queue without running it.
+ *
+ * \param[in]  sched The scheduler.
+ * \param[out] value The value it should be resumed with.
+ * \returns The coroutine, or `NULL` if none are ready.
+ */
+green_thread_t green_sched_next(struct green_sched *sched, green_resume_t *value);
+
+/**
+ * Resume ready coroutines until there are none left.
+ *
+ * Coroutines that await \ref GREEN_SCHED_YIELD are queued again;
+ * those that await \ref GREEN_SCHED_PARK are left
+ * for something else to make ready;
+ * and anything else is passed to `on_await`.
+ * A coroutine that turns out to be running already
+ * (so \ref green_resume fails) is dropped from the queue.
+ *
+ * \param[in] sched The scheduler.
+ * \returns The number of coroutines resumed.
+ */
+size_t green_sched_run(struct green_sched *sched);
+
+/**
+ * Get the scheduler running on the calling pthread.
+ *
+ * \returns
+ *  The scheduler whose \ref green_sched_run is in progress,
+ *  or `NULL` if there is none.
+ */
+struct green_sched *green_sched_self(void);
+
+/**
+ * Let other ready coroutines run (called from a coroutine).
+ *
+ * \returns The value the coroutine was resumed with.
+ */
+green_resume_t green_sched_yield(void);
+
+/**
+ * Wait to be made ready again (called from a coroutine).
+ *
+ * Something else must call \ref green_sched_ready
+ * with this coroutine for it to continue.
+ *
+ * \returns The value given to \ref green_sched_ready.
+ */
+green_resume_t green_sched_park(void);
+
+/**
+ * Get the scheduler a coroutine belongs to.
+ *
+ * This is the scheduler that last ran it
+ * (or that it was moved to by \ref green_migrate),
+ * and so the one whose pthread most likely has its stack in cache.
+ *
+ * \returns The scheduler, or `NULL` if it has never been scheduled.
+ */
+struct green_sched *green_affinity(green_thread_t thread);
+
+/**
+ * Pin a coroutine to the scheduler it belongs to.
+ *
+ * A pinned coroutine is never moved by \ref green_sched_place,
+ * however unbalanced the schedulers get,
+ * but can still be moved explicitly with \ref green_migrate.
+ *
+ * \param[in] thread The coroutine.
+ * \param[in] pinned Non-zero to pin it, zero to unpin it.
+ */
+void green_pin(green_thread_t thread, int pinned);
+
+/**
+ * Move a coroutine to another scheduler.
+ *
+ * This only changes where \ref green_sched_place will send it next;
+ * a coroutine that is already queued stays where it is.
+ */
+void green_migrate(green_thread_t thread, struct green_sched *sched);
+
+/**
+ * Make a coroutine ready on one of several schedulers,
+ * preferring the one it belongs to.
+ *
+ * The coroutine goes to the scheduler it belongs to
+ * (see \ref green_affinity) unless that has more than
+ * its `migrate_threshold` ready coroutines more than the least loaded one,
+ * and the coroutine is not pinned;
+ * then it moves to the least loaded one.
+ * Schedulers on other pthreads are given the coroutine
+ * with \ref green_sched_ready_remote.
+ *
+ * \param[in] scheds   The schedulers to choose from.
+ * \param[in] n_scheds How many schedulers there are.
+ * \param[in] thread   The coroutine.
+ * \param[in] value    The value to resume it with.
+ * \returns
+ *  The index of the scheduler chosen.
+ *  If the coroutine is already queued,
+ *  returns `-1` and sets `errno` to `EALREADY`.
+ */
+int green_sched_place(
+    struct green_sched *const *scheds,
+    size_t n_scheds,
+    green_thread_t thread,
+    green_resume_t value
+);
+
+/** Special value awaited by \ref green_sched_yield. */
+#define GREEN_SCHED_YIELD       ((green_await_t)&green_sched_yield)
+
+/** Special value awaited by \ref green_sched_park. */
+#define GREEN_SCHED_PARK        ((green_await_t)&green_sched_park)
+
+
+/**
+ * A group of child coroutines that are waited on together.
+ *
+ * Children are spawned into the group,
+ * and \ref green_group_wait returns once they have all finished
+ * (or once any of them reports a failure,
+ *  in which case the rest are cancelled).
+ * The group's bookkeeping lives in the children's stack headers,
+ * so the group itself can simply be a local variable of the parent.
+ *
+ * All members are private.
+ */
+struct green_group {
+    struct green_sched *sched;
+    green_thread_t children;
+    green_thread_t waiter;
+    size_t pending;
+    int failed;
+};
+
+/**
+ * Prepare an empty group.
+ *
+ * \param[out] group The group.
+ * \param[in]  sched The scheduler that children
+ *                   (and whoever waits on the group) run on.
+ */
+void green_group_init(struct green_group *group, struct green_sched *sched);
+
+/**
+ * Spawn a child into a group, and make it ready.
+ *
+ * \returns The child, or `NULL` (see \ref green_spawn).
+ */
+green_thread_t green_group_spawn(
+    struct green_group *group,
+    green_start_t start,
+    void *arguments,
+    size_t hint
+);
+
+/**
+ * Report that the group has failed.
+ *
+ * This is usually called by a child.
+ * Whoever is waiting on the group is woken,
+ * and the remaining children are cancelled.
+ */
+void green_group_fail(struct green_group *group);
+
+/**
+ * Cancel every child still in a group (see \ref green_cancel).
+ *
+ * Children that are currently running cannot be cancelled;
+ * they are taken out of the group instead,
+ * and finish on their own without reporting back to it.
+ * Either way, the group has no children left afterwards.
+ */
+void green_group_cancel(struct green_group *group);
+
+/**
+ * Wait for every child in a group to finish.
+ *
+ * From inside a coroutine, this parks until the group is done.
+ * Outside of any coroutine, this runs the group's scheduler instead.
+ *
+ * \returns
+ *  Zero once every child has finished.
+ *  Otherwise, returns `-1` and sets `errno`
+ *  (`ECANCELED` if the group failed,
+ *   in which case the remaining children have been cancelled;
+ *   or `EDEADLK` if called outside of a coroutine
+ *   and every remaining child is waiting on something else).
+ */
+int green_group_wait(struct green_group *group);
+
+
+/**
+ * Something a coroutine can wait for with \ref green_select.
+ *
+ * An event is a flag that stays set until a select consumes it.
+ * Any pthread may set an event,
+ * but only one select may wait on a given event at a time.
+ * Sources like channels or timers can be built by setting an event
+ * whenever they have something to hand over.
+ *
+ * All members are private.
+ */
+struct green_event {
+    uintptr_t state;
+};
+
+/** Prepare an event that is not set. */
+void green_event_init(struct green_event *event);
+
+/**
+ * Set an event.
+ *
+ * If a select is waiting on it, and has not been woken by another event,
+ * the event is consumed and the select's coroutine is made ready.
+ * Otherwise, it stays set for the next select (or \ref green_event_clear).
+ *
+ * \returns `1` if a select was woken, otherwise `0`.
+ */
+int green_event_set(struct green_event *event);
+
+/**
+ * Clear an event without waiting for it.
+ *
+ * \returns `1` if the event was set, otherwise `0`.
+ */
+int green_event_clear(struct green_event *event);
+
+/**
+ * Wait for the first of several events (called from a coroutine).
+ *
+ * The coroutine parks on its scheduler until one event is set,
+ * then consumes that event and stops waiting on the rest,
+ * which are left as they were.
+ * The wait state lives on the caller's stack, so this never allocates.
+ * If the coroutine is cancelled while it waits,
+ * it stops waiting on the events first
+ * (and an event that had already won is left set).
+ *
+ * \param[in] events   The events.
+ * \param[in] n_events How many events there are.
+ * \returns
+ *  The index of the event that was consumed.
+ *  Otherwise, returns `-1` and sets `errno`
+ *  (`EPERM` if not called from a coroutine run by \ref green_sched_run;
+ *   `EINVAL` if there are no events;
+ *   or `EBUSY` if another select is already waiting on one of the events).
+ */
+int green_select(struct green_event *const *events, size_t n_events);
+
+
+/**
+ * A single value handed from one coroutine to another.
+ *
+ * The future usually lives in the waiting coroutine's stack frame,
+ * and is given to whatever will produce the value.
+ * Setting it makes the waiter ready on its scheduler,
+ * so nothing is allocated or locked.
+ *
+ * `event` is set once the value is,
+ * so a future can be waited on alongside other events
+ * with \ref green_select.
+ * Everything else is private.
+ */
+struct green_future {
+    struct green_event event;
+    green_resume_t value;
+    int claimed;
+    int ready;
+};
+
+/** Prepare a future with no value. */
+void green_future_init(struct green_future *future);
+
+/**
+ * Give a future its value, waking whoever is waiting on it.
+ *
+ * This may be called from any pthread.
+ *
+ * \returns
+ *  Zero on success.
+ *  If the future already has a value,
+ *  returns `-1` and sets `errno` to `EALREADY`.
+ */
+int green_future_set(struct green_future *future, green_resume_t value);
+
+/** Check whether a future has its value yet. */
+int green_future_ready(const struct green_future *future);
+
+/**
+ * Wait for a future's value (called from a coroutine).
+ *
+ * If the value is not there yet,
+ * the coroutine parks on its scheduler until it is.
+ *
+ * \returns
+ *  The value.
+ *  If the value is not ready and this was not called from
+ *  a coroutine run by \ref green_sched_run,
+ *  returns `GREEN_AWAIT_FAILED` and sets `errno` to `EPERM`.
+ */
+green_resume_t green_future_get(struct green_future *future);
+
+
+#ifndef GREEN_PREEMPT_SIGNAL
+/**
+ * The signal used for time slices (see \ref green_preempt_start).
+ *
+ * Its handler is installed with `SA_ONSTACK`,
+ * and runs on an alternate stack green sets up for the pthread
+ * unless the pthread already has one.
+ * It is also installed with `SA_RESTART`,
+ * but that does not restart every call:
+ * `poll`, `epoll_wait`, `nanosleep` and the like
+ * still fail with `EINTR` when a slice ends during them.
+ */
+ #define GREEN_PREEMPT_SIGNAL   SIGURG
+#endif
+
+/**
+ * Start time-slicing coroutines on the calling pthread.
+ *
+ * A timer sends \ref GREEN_PREEMPT_SIGNAL to this pthread
+ * every `slice_us` microseconds,
+ * which marks the current slice as spent
+ * if at least that long has passed since it started.
+ * Coroutines are not interrupted;
+ * instead, long-running loops should call \ref green_maybe_yield
+ * every so often.
+ * The slice is restarted each time \ref green_sched_run
+ * resumes a coroutine (or by \ref green_preempt_reset),
+ * so a coroutine runs for at least one slice
+ * and at most about two before it is asked to yield.
+ *
+ * \param[in] slice_us The length of a slice in microseconds.
+ * \returns
+ *  Zero on success.
+ *  Otherwise, returns `-1` and sets `errno`
+ *  (`EALREADY` if already started on this pthread;
+ *   for other values, see `timer_create(2)`).
+ */
+int green_preempt_start(unsigned long slice_us);
+
+/** Stop time-slicing coroutines on the calling pthread. */
+void green_preempt_stop(void);
+
+/** Start a new time slice on the calling pthread. */
+void green_preempt_reset(void);
+
+/**
+ * Yield if the current time slice has been spent.
+ *
+ * This is cheap enough to call in any loop
+ * that might run for a long time without awaiting.
+ * If the slice has been spent,
+ * the coroutine's overrun count is incremented
+ * and it awaits \ref GREEN_SCHED_YIELD.
+ *
+ * \returns `1` if the coroutine yielded, otherwise `0`.
+ */
+int green_maybe_yield(void);
+
+/**
+ * Get how many times a coroutine has overrun its time slice.
+ *
+ * \param[in] thread The coroutine.
+ * \returns The number of times \ref green_maybe_yield yielded it.
+ */
+unsigned long green_preempt_overruns(green_thread_t thread);
+
+
+#ifndef GREEN_WATCHDOG_SIGNAL
+/**
+ * The signal the watchdog uses to sample a stalled pthread.
+ *
+ * Like \ref GREEN_PREEMPT_SIGNAL, its handler runs on an alternate stack.
+ */
+ #define GREEN_WATCHDOG_SIGNAL  SIGPROF
+#endif
+
+/** What the watchdog found on a stalled pthread. */
+struct green_stall {
+    /** The coroutine that has been running without switching. */
+    green_thread_t thread;
+    /** The function it was spawned with, or `NULL` if it could not be sampled. */
+    green_start_t start;
+    /** Its stack pointer when sampled, or `NULL` if it could not be sampled. */
+    void *sp;
+    /** Its program counter when sampled, or `NULL` if it could not be sampled. */
+    void *pc;
+    /** How long it had gone without switching. */
+    unsigned long stalled_us;
+    /** The context the pthread passed to \ref green_watchdog_attach. */
+    void *worker;
+};
+
+/**
+ * Called from the watchdog's own pthread for each stall it finds.
+ *
+ * The coroutine may have moved on (or finished) by the time this runs,
+ * so the report should not touch it;
+ * nor may this call any of the `green_watchdog_` functions.
+ */
+typedef void (*green_stall_report_t)(const struct green_stall *stall, void *context);
+
+/**
+ * Start a watchdog pthread that reports coroutines
+ * which stall the pthread they run on.
+ *
+ * Each attached pthread counts every \ref green_resume it makes
+ * (inline or not).
+ * If a coroutine stays current for `threshold_us`
+ * without that count changing,
+ * whether it is spinning or blocked in a system call,
+ * the watchdog sends \ref GREEN_WATCHDOG_SIGNAL to the pthread
+ * to find out where it is, and reports it once.
+ * A pthread with no coroutine running (such as a scheduler waiting for work)
+ * is never reported.
+ * Stalls are noticed between one and one and a quarter thresholds in.
+ *
+ * \param[in] threshold_us How long a coroutine may run without switching.
+ * \param[in] report       What to call with each stall.
+ * \param[in] context      Passed to `report`.
+ * \returns
+ *  Zero on success.
+ *  Otherwise, returns `-1` and sets `errno`
+ *  (`EALREADY` if the watchdog is already running,
+ *   `EINVAL` if `threshold_us` is zero or `report` is `NULL`;
+ *   for other values, see `pthread_create(3)`).
+ */
+int green_watchdog_start(
+    unsigned long threshold_us,
+    green_stall_report_t report,
+    void *context
+);
+
+/** Stop the watchdog, waiting for it to finish any report in progress. */
+void green_watchdog_stop(void);
+
+/**
+ * Have the watchdog watch the calling pthread.
+ *
+ * Pthreads may attach before or after the watchdog starts,
+ * and are detached automatically when they exit.
+ * An attached pthread gets an alternate signal stack
+ * (see `sigaltstack(2)`) unless it already has one.
+ *
+ * \param[in] worker_context Passed back in \ref green_stall::worker.
+ * \returns
+ *  Zero on success.
+ *  Otherwise, returns `-1` and sets `errno`
+ *  (`EALREADY` if already attached, `ENOMEM`;
+ *   for other values, see `mmap(2)`).
+ */
+int green_watchdog_attach(void *worker_context);
+
+/** Stop watching the calling pthread. */
+void green_watchdog_detach(void);
+
 
 /** Special value indicating a bad call to \ref green_resume. */
 #define GREEN_RESUME_FAILED     ((green_await_t)&green_resume)
@@ -0,0 +1,723 @@
+#ifndef GREEN_HPP
+#define GREEN_HPP
+
+/* This file is part of https://github.com/NelsonCrosby/green.c */
+/* BSD 2-Clause License                                                      *
+ *                                                                           *
+ * Copyright (c) 2020, Nelson Crosby <nelson@tika.to>                        *
+ * All rights reserved.                                                      *
+ *                                                                           *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "green.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+ #define GREEN_HPP_COAWAIT 1
+ #include <coroutine>
+ #include <exception>
+ #include <optional>
+ #include <sched.h>
+#else
+ #define GREEN_HPP_COAWAIT 0
+#endif
+
+#ifndef GREEN_HPP_BRIDGE_FRAME
+ /** Space kept on the stack for \ref green::wait's stackless frame. */
+ #define GREEN_HPP_BRIDGE_FRAME    256
+#endif
+
+/** \file
+ * C++ wrapper around the green API.
+ *
+ * \ref green::spawn starts any callable as a coroutine,
+ * constructing the callable directly on the coroutine's own stack
+ * (see \ref green_spawn_args), so nothing is allocated for it.
+ * It returns a move-only \ref green::coroutine,
+ * which cancels the coroutine when destroyed.
+ *
+ * Both sides of a coroutine agree on the types it awaits and is resumed with,
+ * so values no longer have to be cast to and from
+ * \ref green_await_t and \ref green_resume_t:
+ *
+ * ```cpp
+ * auto co = green::spawn<int, const char>([](auto self) {
+ *     int answer = 42;
+ *     const char *reply = self.await(&answer);
+ * });
+ * int *answer = co.resume();
+ * co.resume("thanks");
+ * ```
+ *
+ * As with the C API, awaiting `nullptr` stops the coroutine on the spot,
+ * and a coroutine that is cancelled part way through
+ * does not unwind its stack;
+ * only the callable itself is destroyed.
+ * Exceptions must not escape a coroutine's callable.
+ *
+ * From C++20, \ref green::join lets a stackless coroutine `co_await`
+ * a green coroutine finishing,
+ * and \ref green::wait lets a green coroutine wait on anything
+ * a stackless coroutine could `co_await`.
+ * Neither allocates, and neither assumes a particular scheduler.
+ */
+
+
+namespace green {
+
+
+namespace detail {
+
+// Values pass through green as opaque (non-const) pointers
+template <typename T>
+inline green_await_t to_await(T *value) noexcept
+{
+    return reinterpret_cast<green_await_t>(const_cast<std::remove_cv_t<T> *>(value));
+}
+
+template <typename T>
+inline green_resume_t to_resume(T *value) noexcept
+{
+    return reinterpret_cast<green_resume_t>(const_cast<std::remove_cv_t<T> *>(value));
+}
+
+} // namespace detail
+
+
+/**
+ * What a coroutine's callable is given to await with.
+ *
+ * \tparam Await  What the coroutine awaits with.
+ * \tparam Resume What the coroutine is resumed with.
+ */
+template <typename Await = void, typename Resume = void>
+class context {
+public:
+    /** Typed \ref green_await. */
+    Resume *await(Await *value) const noexcept
+    {
+        return reinterpret_cast<Resume *>(green_await(detail::to_await(value)));
+    }
+};
+
+
+/**
+ * Untyped-at-the-call-site \ref green_await,
+ * for code called by a coroutine's callable.
+ */
+template <typename Resume = void, typename Await>
+inline Resume *await(Await *value) noexcept
+{
+    return reinterpret_cast<Resume *>(green_await(detail::to_await(value)));
+}
+
+
+namespace detail {
+
+// Lets something else hear when a coroutine from spawn finishes
+struct completion {
+    void (*notify)(void *context) = nullptr;
+    void *context = nullptr;
+};
+
+// What spawn puts at the top of the coroutine's stack
+template <typename Fn>
+struct closure {
+    Fn fn;
+    completion done;
+
+    template <typename F>
+    explicit closure(F &&f) : fn(std::forward<F>(f)) {}
+};
+
+template <typename Fn>
+void discard(void *frame) noexcept
+{
+    static_cast<closure<Fn> *>(frame)->~closure();
+}
+
+template <typename Fn>
+void finish(void *frame) noexcept
+{
+    completion done = static_cast<closure<Fn> *>(frame)->done;
+    discard<Fn>(frame);
+    if (done.notify != nullptr)
+        done.notify(done.context);
+}
+
+template <typename Fn, typename Await, typename Resume>
+void start(void *frame) noexcept
+{
+    Fn &fn = static_cast<closure<Fn> *>(frame)->fn;
+    struct green_cleanup cleanup;
+
+    // Destroy the callable (and say so) however the coroutine ends
+    green_cleanup_push(&cleanup, &finish<Fn>, frame);
+    if constexpr (std::is_invocable_v<Fn &, context<Await, Resume>>)
+        fn(context<Await, Resume>());
+    else
+        fn();
+    green_cleanup_pop(1);
+}
+
+} // namespace detail
+
+
+/**
+ * An owning handle to a coroutine.
+ *
+ * Destroying (or assigning over) the handle cancels the coroutine;
+ * if \ref green_cancel refuses it (because it is running,
+ * or waiting in \ref green_offload), it is released instead,
+ * and frees itself when it finishes.
+ *
+ * \tparam Await  What the coroutine awaits with.
+ * \tparam Resume What the coroutine is resumed with.
+ */
+template <typename Await = void, typename Resume = void>
+class coroutine {
+public:
+    coroutine() noexcept = default;
+
+    /** Take ownership of a coroutine created with \ref green_spawn. */
+    explicit coroutine(green_thread_t thread) noexcept : thread_(thread) {}
+
+    coroutine(coroutine &&other) noexcept
+        : thread_(std::exchange(other.thread_, nullptr)),
+          discard_(std::exchange(other.discard_, nullptr)),
+          frame_(std::exchange(other.frame_, nullptr)),
+          done_(std::exchange(other.done_, nullptr))
+    {
+        watch();
+    }
+
+    coroutine &operator=(coroutine &&other) noexcept
+    {
+        if (this != &other) {
+            drop();
+            thread_ = std::exchange(other.thread_, nullptr);
+            discard_ = std::exchange(other.discard_, nullptr);
+            frame_ = std::exchange(other.frame_, nullptr);
+            done_ = std::exchange(other.done_, nullptr);
+            watch();
+        }
+        return *this;
+    }
+
+    coroutine(const coroutine &) = delete;
+    coroutine &operator=(const coroutine &) = delete;
+
+    ~coroutine() { drop(); }
+
+    /**
+     * Typed \ref green_resume.
+     *
+     * \returns
+     *  What the coroutine awaited with,
+     *  or `nullptr` once it has finished (after which this handle is empty).
+     * \throws std::system_error
+     *  With `ESRCH` if this handle is empty,
+     *  or `EBUSY` if the coroutine is running.
+     */
+    Await *resume(Resume *value = nullptr)
+    {
+        if (thread_ == nullptr)
+            throw std::system_error(ESRCH, std::generic_category(), "green_resume");
+
+        green_await_t awaited = green_resume(thread_, detail::to_resume(value));
+        if (awaited == GREEN_RESUME_FAILED)
+            throw std::system_error(EBUSY, std::generic_category(), "green_resume");
+
+        // The coroutine has started, so it destroys its own callable now
+        discard_ = nullptr;
+        if (awaited == nullptr) {
+            thread_ = nullptr;
+            frame_ = nullptr;
+            done_ = nullptr;
+        }
+        return reinterpret_cast<Await *>(awaited);
+    }
+
+    /**
+     * Whether the coroutine has finished (or this handle is empty).
+     *
+     * A coroutine from \ref green::spawn empties its handle when it finishes,
+     * even if something else resumed it
+     * (such as \ref green::wait_direct's wake).
+     * A handle made from a raw \ref green_thread_t cannot tell,
+     * so \ref release it before the coroutine is finished elsewhere.
+     */
+    bool done() const noexcept { return thread_ == nullptr; }
+
+    explicit operator bool() const noexcept { return thread_ != nullptr; }
+
+    /** The underlying handle. */
+    green_thread_t get() const noexcept { return thread_; }
+
+    /**
+     * Give up ownership of the coroutine.
+     *
+     * If it has not started yet, its callable is only destroyed
+     * once it runs to completion.
+     */
+    green_thread_t release() noexcept
+    {
+        if (done_ != nullptr)
+            done_->notify = nullptr;
+        discard_ = nullptr;
+        frame_ = nullptr;
+        done_ = nullptr;
+        return std::exchange(thread_, nullptr);
+    }
+
+    /**
+     * Cancel the coroutine (see \ref green_cancel), if there is one.
+     *
+     * \returns
+     *  `true` if the handle is now empty.
+     *  If \ref green_cancel refused the coroutine,
+     *  returns `false` with `errno` set and keeps the handle.
+     */
+    bool reset() noexcept
+    {
+        if (thread_ == nullptr)
+            return true;
+
+        // An unstarted callable lives on the stack being freed,
+        // and nothing else can be running a coroutine that has not started
+        if (discard_ != nullptr)
+            discard_(frame_);
+        if (green_cancel(thread_) != 0) {
+            discard_ = nullptr;
+            return false;
+        }
+
+        thread_ = nullptr;
+        discard_ = nullptr;
+        frame_ = nullptr;
+        done_ = nullptr;
+        return true;
+    }
+
+private:
+    template <typename A, typename R, typename F>
+    friend coroutine<A, R> spawn(F &&fn, std::size_t hint);
+
+#if GREEN_HPP_COAWAIT
+    template <typename A, typename R, typename Launch>
+    friend auto join(coroutine<A, R> &&co, Launch launch);
+#endif
+
+    coroutine(
+        green_thread_t thread,
+        void (*discard)(void *),
+        void *frame,
+        detail::completion *done
+    ) noexcept
+        : thread_(thread), discard_(discard), frame_(frame), done_(done)
+    {
+        watch();
+    }
+
+    // A coroutine that cannot be cancelled is left to finish by itself
+    void drop() noexcept
+    {
+        if (!reset())
+            release();
+    }
+
+    // Have the coroutine empty this handle when it finishes
+    void watch() noexcept
+    {
+        if (done_ != nullptr) {
+            done_->notify = &finished;
+            done_->context = this;
+        }
+    }
+
+    static void finished(void *self) noexcept
+    {
+        coroutine *co = static_cast<coroutine *>(self);
+        co->thread_ = nullptr;
+        co->discard_ = nullptr;
+        co->frame_ = nullptr;
+        co->done_ = nullptr;
+    }
+
+    green_thread_t thread_ = nullptr;
+    // Destroys the callable if the coroutine is cancelled before it starts
+    void (*discard_)(void *) = nullptr;
+    void *frame_ = nullptr;
+    detail::completion *done_ = nullptr;
+};
+
+
+/**
+ * Start a callable as a coroutine.
+ *
+ * The callable is moved (or copied) onto the top of the coroutine's stack.
+ * It is called with a \ref green::context if it accepts one,
+ * and with no arguments otherwise.
+ *
+ * \tparam Await  What the coroutine awaits with.
+ * \tparam Resume What the coroutine is resumed with.
+ * \param[in] fn   The callable.
+ * \param[in] hint Size of the stack (see \ref green_spawn).
+ * \throws std::system_error If the stack could not be allocated.
+ */
+template <typename Await = void, typename Resume = void, typename F>
+coroutine<Await, Resume> spawn(F &&fn, std::size_t hint = 0)
+{
+    using Fn = std::decay_t<F>;
+    using Frame = detail::closure<Fn>;
+    static_assert(alignof(Frame) <= 16, "callable is over-aligned for a coroutine stack");
+
+    green_thread_t thread = green_spawn(&detail::start<Fn, Await, Resume>, nullptr, hint);
+    if (thread == nullptr)
+        throw std::system_error(errno, std::generic_category(), "green_spawn");
+
+    void *space = green_spawn_args(thread, sizeof(Frame));
+    if (space == nullptr) {
+        int error = errno;
+        green_cancel(thread);
+        throw std::system_error(error, std::generic_category(), "green_spawn_args");
+    }
+
+    Frame *frame;
+    try {
+        frame = ::new (space) Frame(std::forward<F>(fn));
+    } catch (...) {
+        green_cancel(thread);
+        throw;
+    }
+
+    return coroutine<Await, Resume>(thread, &detail::discard<Fn>, frame, &frame->done);
+}
+
+
+#if GREEN_HPP_COAWAIT
+
+namespace detail {
+
+template <typename Launch>
+class join_awaiter {
+public:
+    join_awaiter(green_thread_t thread, completion *done, Launch launch)
+        : thread_(thread), done_(done), launch_(std::move(launch))
+    {}
+
+    bool await_ready() const noexcept { return thread_ == nullptr; }
+
+    void await_suspend(std::coroutine_handle<> waiter)
+    {
+        green_thread_t thread = thread_;
+        Launch launch = std::move(launch_);
+
+        done_->notify = &join_awaiter::wake;
+        done_->context = waiter.address();
+        // The waiter may be resumed (and this awaiter gone) before this returns
+        launch(thread);
+    }
+
+    void await_resume() const noexcept {}
+
+private:
+    static void wake(void *waiter) noexcept
+    {
+        std::coroutine_handle<>::from_address(waiter).resume();
+    }
+
+    green_thread_t thread_;
+    completion *done_;
+    Launch launch_;
+};
+
+// The state shared between a green coroutine in green::wait
+// and the stackless coroutine awaiting on its behalf
+struct bridge {
+    enum { RUNNING, WAITING, DONE };
+
+    green_thread_t thread;
+    void (*wake)(green_thread_t thread, void *context);
+    void *context;
+    std::exception_ptr error;
+    int state = RUNNING;
+    alignas(16) unsigned char buffer[GREEN_HPP_BRIDGE_FRAME];
+
+    void complete() noexcept
+    {
+        green_thread_t waiting = thread;
+        void (*wake_fn)(green_thread_t, void *) = wake;
+        void *wake_context = context;
+
+        // Once this is DONE, the green side may return and take this with it
+        if (__atomic_exchange_n(&state, DONE, __ATOMIC_ACQ_REL) == WAITING)
+            wake_fn(waiting, wake_context);
+    }
+};
+
+struct bridge_task {
+    // The bridge about to be given to drive
+    static inline thread_local bridge *allocating = nullptr;
+
+    struct promise_type {
+        bridge &shared;
+
+        template <typename... Args>
+        promise_type(bridge &shared, Args &&...) noexcept : shared(shared) {}
+
+        // The frame lives in the bridge when it fits,
+        // with a flag in front saying whether it had to go on the heap
+        static void *operator new(std::size_t size)
+        {
+            bridge &shared = *allocating;
+            unsigned char *base = shared.buffer;
+            if (size + 16 > sizeof(shared.buffer))
+                base = static_cast<unsigned char *>(::operator new(size + 16));
+            *base = base != shared.buffer;
+            return base + 16;
+        }
+
+        static void operator delete(void *frame) noexcept
+        {
+            unsigned char *base = static_cast<unsigned char *>(frame) - 16;
+            if (*base)
+                ::operator delete(base);
+        }
+
+        struct final_awaiter {
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<promise_type> self) const noexcept
+            {
+                bridge &shared = self.promise().shared;
+                self.destroy();
+                shared.complete();
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        bridge_task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        final_awaiter final_suspend() const noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { shared.error = std::current_exception(); }
+    };
+};
+
+template <typename Awaitable>
+decltype(auto) get_awaiter(Awaitable &&awaitable)
+{
+    if constexpr (requires { static_cast<Awaitable &&>(awaitable).operator co_await(); })
+        return static_cast<Awaitable &&>(awaitable).operator co_await();
+    else if constexpr (requires { operator co_await(static_cast<Awaitable &&>(awaitable)); })
+        return operator co_await(static_cast<Awaitable &&>(awaitable));
+    else
+        return static_cast<Awaitable &&>(awaitable);
+}
+
+template <typename Awaitable>
+using await_result_t =
+    decltype(get_awaiter(std::declval<Awaitable>()).await_resume());
+
+// Holds what the awaitable produced, references included
+template <typename T>
+struct result {
+    std::optional<T> value;
+    template <typename U> void set(U &&u) { value.emplace(std::forward<U>(u)); }
+    T get() { return std::move(*value); }
+};
+
+template <typename T>
+struct result<T &> {
+    T *value = nullptr;
+    void set(T &u) noexcept { value = &u; }
+    T &get() noexcept { return *value; }
+};
+
+template <typename Awaitable, typename Result>
+bridge_task drive(bridge &, Awaitable &&awaitable, Result &out)
+{
+    if constexpr (std::is_void_v<await_result_t<Awaitable>>)
+        co_await static_cast<Awaitable &&>(awaitable);
+    else
+        out.set(co_await static_cast<Awaitable &&>(awaitable));
+}
+
+// Whatever the coroutine awaits next comes back here, and is dropped
+inline void wake_resume(green_thread_t thread, void *) noexcept
+{
+    // The green side may still be on its way into green_await
+    while (green_resume(thread, nullptr) == GREEN_RESUME_FAILED)
+        sched_yield();
+}
+
+inline void wake_sched(green_thread_t thread, void *sched) noexcept
+{
+    green_sched_ready_remote(static_cast<struct green_sched *>(sched), thread, nullptr);
+}
+
+} // namespace detail
+
+
+/**
+ * Have a stackless coroutine wait for a coroutine from \ref green::spawn
+ * to finish, however it finishes.
+ *
+ * ```cpp
+ * co_await green::join(std::move(co), [&](green_thread_t thread) {
+ *     green_sched_ready(&sched, thread, nullptr);
+ * });
+ * ```
+ *
+ * The handle's ownership passes to the awaiter,
+ * which hands the coroutine to `launch` once the waiter is suspended.
+ * From then on, whatever resumes the coroutine owns it.
+ * When it finishes (or is cancelled),
+ * the waiter is resumed right there, on that stack.
+ *
+ * \param[in] co     The coroutine.
+ * \param[in] launch Called with the coroutine to get it going,
+ *                   for example by readying it on a scheduler.
+ * \throws std::system_error
+ *  With `EINVAL` if the coroutine was not started by \ref green::spawn.
+ */
+template <typename Await, typename Resume, typename Launch>
+auto join(coroutine<Await, Resume> &&co, Launch launch)
+{
+    if (co.thread_ != nullptr && co.done_ == nullptr)
+        throw std::system_error(EINVAL, std::generic_category(), "green::join");
+
+    detail::completion *done = co.done_;
+    green_thread_t thread = co.release();
+    return detail::join_awaiter<Launch>(thread, done, std::move(launch));
+}
+
+/**
+ * Wait for anything a stackless coroutine could `co_await`,
+ * from a green coroutine.
+ *
+ * The awaitable is awaited by a small stackless coroutine,
+ * whose frame is kept on this coroutine's stack
+ * (unless it is larger than `GREEN_HPP_BRIDGE_FRAME`).
+ * If that has to suspend,
+ * this coroutine calls \ref green_await with `wait_for`,
+ * and is woken with `wake(thread, context)`
+ * once the awaitable completes.
+ * Nothing else should resume it in the meantime.
+ *
+ * \param[in] awaitable The awaitable.
+ * \param[in] wait_for  What to await with while waiting.
+ * \param[in] wake      Called from wherever the awaitable completes
+ *                      to get this coroutine going again.
+ * \param[in] context   Passed straight through to `wake`.
+ * \returns What `co_await awaitable` gave (exceptions are rethrown here).
+ */
+template <typename Awaitable>
+detail::await_result_t<Awaitable> wait(
+    Awaitable &&awaitable,
+    green_await_t wait_for,
+    void (*wake)(green_thread_t thread, void *context),
+    void *context = nullptr
+) {
+    using T = detail::await_result_t<Awaitable>;
+    using Result = std::conditional_t<std::is_void_v<T>, int, detail::result<T>>;
+    detail::bridge shared;
+    Result out{};
+
+    shared.thread = green_self();
+    shared.wake = wake;
+    shared.context = context;
+    detail::bridge_task::allocating = &shared;
+    detail::drive(shared, static_cast<Awaitable &&>(awaitable), out);
+
+    int state = detail::bridge::RUNNING;
+    if (__atomic_compare_exchange_n(
+        &shared.state, &state, detail::bridge::WAITING,
+        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+    )) {
+        while (__atomic_load_n(&shared.state, __ATOMIC_ACQUIRE) != detail::bridge::DONE)
+            green_await(wait_for);
+    }
+
+    if (shared.error)
+        std::rethrow_exception(shared.error);
+    if constexpr (!std::is_void_v<T>)
+        return out.get();
+}
+
+/**
+ * Wait for anything a stackless coroutine could `co_await`,
+ * from a green coroutine being run by \ref green_sched_run.
+ *
+ * This parks the coroutine on its scheduler until the awaitable completes
+ * (wherever that happens), as in \ref green_sched_park.
+ *
+ * \throws std::system_error
+ *  With `EPERM` if not called from a coroutine run by a scheduler.
+ */
+template <typename Awaitable>
+detail::await_result_t<Awaitable> wait(Awaitable &&awaitable)
+{
+    struct green_sched *sched = green_sched_self();
+    if (sched == nullptr || green_self() == nullptr)
+        throw std::system_error(EPERM, std::generic_category(), "green::wait");
+
+    return wait(static_cast<Awaitable &&>(awaitable),
+                GREEN_SCHED_PARK, &detail::wake_sched, sched);
+}
+
+/**
+ * Like \ref green::wait, but woken by resuming it directly
+ * (with \ref green_resume) from wherever the awaitable completes.
+ *
+ * This suits coroutines that nothing else is managing.
+ * If the awaitable completes while the coroutine is still on its way
+ * into \ref green_await, the wake spins (yielding the pthread) until
+ * the coroutine can be resumed.
+ * The coroutine then runs until it next awaits,
+ * and that value goes back to the wake, which drops it;
+ * use \ref green::wait with a wake of your own if it matters.
+ * If the coroutine instead runs to the end inside that resume,
+ * its \ref green::coroutine handle is emptied
+ * (see \ref green::coroutine::done).
+ */
+template <typename Awaitable>
+detail::await_result_t<Awaitable> wait_direct(Awaitable &&awaitable, green_await_t wait_for)
+{
+    return wait(static_cast<Awaitable &&>(awaitable), wait_for, &detail::wake_resume);
+}
+
+#endif // GREEN_HPP_COAWAIT
+
+
+} // namespace green
+
+#endif // include guard
@@ -28,13 +28,17 @@
 
 	.text
 
+	# Size of struct _green_ext (see green.c), which sits below the header
+	.set	_GREEN_EXT_SIZE, 224
+
 	.globl	green_spawn
 	.globl	green_resume
 	.globl	green_await
 
 # green_thread_t green_spawn(green_start_t start, void *arguments, size_t hint);
 green_spawn:
-	enter	$24, $0
+	# (32 rather than 24 keeps the stack aligned for the call below)
+	enter	$32, $0
 	# Save start, arguments for a second
 	movq	%rdi, -8(%rbp)
 	movq	%rsi, -16(%rbp)
@@ -49,18 +53,13 @@ green_spawn:
 _alloc:
 	# Save length for a second
 	movq	%rsi, -24(%rbp)
-	# mmap(NULL, hint, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0)
-	movq	$0, %rdi
-	movl	$3, %edx
-	movl	$0x22, %ecx
-	movl	$-1, %r8d
-	movq	$0, %r9
-	call	mmap
-
-	cmpq	$-1, %rax
-	jne	_alloc_ok
-	# mmap returned MAP_FAILED; gotta return NULL.
-	movq	$0, %rax
+	# _green_stack_alloc(&length) (rounds length up to its size class)
+	leaq	-24(%rbp), %rdi
+	call	_green_stack_alloc
+
+	testq	%rax, %rax
+	jnz	_alloc_ok
+	# Allocation failed; gotta return NULL.
 	leave
 	ret
 
@@ -78,11 +77,11 @@ _alloc_ok:
 	#   void (*start)(void *arguments);                     // -24
 	#   void *arguments;                                    // -32
 	#   size_t alloc_length;                                // -40
-	#   long padding;                                       // -48
-	#   void *_thread_call_retptr;  // initial stack top    // -56
+	#   struct green_cleanup *cleanup;                      // -48
+	#   struct _green_ext ext;                              // -48 - EXT
+	#   void *_thread_call_retptr;  // initial stack top    // -56 - EXT
 	# }
-	leaq	-56(%rax), %rdi
-	addq	$-48, %rdi
+	leaq	-(104 + _GREEN_EXT_SIZE)(%rax), %rdi
 	movq	%rax, -8(%rax)
 	movq	%rdi, -16(%rax)
 	movq	%rdx, -24(%rax)
@@ -97,34 +96,33 @@ _alloc_ok:
 
 _thread_call:
 	# thread->start(arguments)
-	movq	16(%rsp), %rdi
-	call	*24(%rsp)
+	# (found through the handle, since green_spawn_args
+	#  may have moved this frame down the stack)
+	call	_green_current
+	movq	(%rax), %rax
+	movq	-32(%rax), %rdi
+	call	*-24(%rax)
 
 _thread_return:
 	call	_green_current
-	# NOTE: *current should always be %rsi + 56,
-	#	and -8(*current) should never be *current,
-	#       because if a thread is returning it must be active...
-	#       right?
 
+_thread_finish:
 	# Restore last active thread
 	movq	(%rax), %rdi
-	movq	-8(%rdi), %rdi
-	movq	%rdi, (%rax)
+	movq	-8(%rdi), %rsi
+	movq	%rsi, (%rax)
 
-	# Prepare munmap arguments
-	leaq	48(%rsp), %rdi
-	movq	-40(%rdi), %rsi
 	# Hop back to calling stack
 	movq	-16(%rdi), %rsp
 
-	# resolve bottom of allocation
-	subq	%rsi, %rdi
-	# munmap(thread - thread->alloc_length, thread->alloc_length)
-	call	munmap
+	# _green_release(thread) runs cleanups and frees the stack
+	# (keeping the stack aligned for the call)
+	subq	$8, %rsp
+	call	_green_release
+	addq	$8, %rsp
 
-	# restore saved registers and return
-	# (uses zero returned from munmap)
+	# restore saved registers and return NULL
+	xorl	%eax, %eax
 	popq	%r15
 	popq	%r14
 	popq	%r13
@@ -137,13 +135,15 @@ _thread_return:
 # green_await_t green_resume(green_thread_t thread, green_resume_t resume_with);
 green_resume:
 	# Get thread-local current thread (green_thread_t *)
+	# and switch count (unsigned long *)
 	pushq	%rsi
 	pushq	%rdi
-	call	_green_current
+	call	_green_resuming
 	popq	%rdi
 	popq	%rsi
 
 	movq	%rax, %r8
+	movq	%rdx, %r9
 	# Try to activate thread
 	movq	(%r8), %rcx
 	movq	%rdi, %rax
@@ -154,6 +154,8 @@ lock	cmpxchg	%rcx, -8(%rdi)
 	ret
 
 _resume_activate_ok:
+	# Count the switch for the watchdog
+	incq	(%r9)
 	# Set thread as current
 	movq	%rdi, (%r8)
 
@@ -208,6 +210,13 @@ green_await:
 	ret
 
 _await_ok:
+	# Awaiting NULL stops the thread early
+	cmpq	$0, %rax
+	jne	_await_switch
+	movq	%r8, %rax
+	jmp	_thread_finish
+
+_await_switch:
 	# Save necessary registers
 	pushq	%rbp
 	pushq	%rbx
@@ -0,0 +1,259 @@
+#ifndef GREEN_INLINE_H
+#define GREEN_INLINE_H
+
+/* This file is part of https://github.com/NelsonCrosby/green.c */
+/* BSD 2-Clause License                                                      *
+ *                                                                           *
+ * Copyright (c) 2020, Nelson Crosby <nelson@tika.to>                        *
+ * All rights reserved.                                                      *
+ *                                                                           *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "green.h"
+
+/** \file
+ * Inlinable versions of \ref green_resume and \ref green_await.
+ *
+ * The functions in this header perform exactly the same switch
+ * as their out-of-line counterparts,
+ * using the same stack header and saved-register layout,
+ * so the two can be mixed freely on the same coroutine.
+ * However, since the compiler can see the switch,
+ * it only has to preserve the registers that are actually live across it,
+ * rather than every callee-saved register on every switch.
+ *
+ * These are most useful in tight loops
+ * (such as a consumer repeatedly resuming a generator),
+ * where the cost of the call itself dominates.
+ */
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/** The current coroutine of the calling pthread (internal). */
+extern __thread green_thread_t _green_active;
+/** How many times the calling pthread has resumed a coroutine (internal). */
+extern __thread unsigned long _green_switches;
+
+
+#if defined(__x86_64__)
+
+ #define _GREEN_INLINE_LAST_ACTIVE(thread)  (((green_thread_t *)(thread))[-1])
+
+ /*
+  * Unlike green.x86_64.s, only %rbp and the return address
+  * are actually saved in the switch frame;
+  * the slots for %rbx and %r12-%r15 are left as garbage
+  * and those registers are clobbered instead.
+  * The red zone is skipped over, since it may be in use,
+  * and the frame is aligned the way green_resume's call leaves it
+  * (a finishing coroutine calls _green_release on top of it);
+  * the stack pointer from before is kept just above the frame.
+  */
+ #define _GREEN_INLINE_SWITCH_OUT               \
+    "movq   %%rsp, %%rcx            \n\t"       \
+    "leaq   -128(%%rsp), %%rsp      \n\t"       \
+    "andq   $-16, %%rsp             \n\t"       \
+    "pushq  %%rcx                   \n\t"       \
+    "subq   $8, %%rsp               \n\t"       \
+    "leaq   1f(%%rip), %%rdx        \n\t"       \
+    "pushq  %%rdx                   \n\t"       \
+    "pushq  %%rbp                   \n\t"       \
+    "subq   $40, %%rsp              \n\t"       \
+    "movq   -16(%[thread]), %%rdx   \n\t"       \
+    "movq   %%rsp, -16(%[thread])   \n\t"       \
+    "movq   %%rdx, %%rsp            \n\t"
+
+ #define _GREEN_INLINE_SWITCH_IN                \
+    "popq   %%r15                   \n\t"       \
+    "popq   %%r14                   \n\t"       \
+    "popq   %%r13                   \n\t"       \
+    "popq   %%r12                   \n\t"       \
+    "popq   %%rbx                   \n\t"       \
+    "popq   %%rbp                   \n\t"       \
+    "ret                            \n"         \
+    "1:                             \n\t"       \
+    "movq   8(%%rsp), %%rsp         \n\t"
+
+ #ifdef __AVX512F__
+  #define _GREEN_INLINE_CLOBBER_AVX512                                  \
+    "xmm16", "xmm17", "xmm18", "xmm19", "xmm20", "xmm21", "xmm22", "xmm23", \
+    "xmm24", "xmm25", "xmm26", "xmm27", "xmm28", "xmm29", "xmm30", "xmm31",
+ #else
+  #define _GREEN_INLINE_CLOBBER_AVX512
+ #endif
+
+ #define _GREEN_INLINE_CLOBBER                                          \
+    "rbx", "rcx", "rdx", "r8", "r9", "r10", "r11",                      \
+    "r12", "r13", "r14", "r15",                                         \
+    "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",     \
+    "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15", \
+    _GREEN_INLINE_CLOBBER_AVX512                                        \
+    "st", "st(1)", "st(2)", "st(3)", "st(4)", "st(5)", "st(6)", "st(7)", \
+    "cc", "memory"
+
+ #define _GREEN_INLINE_REGS(value, thread, current)         \
+    register void *_value __asm__("rax") = (value);         \
+    register void *_thread __asm__("rdi") = (thread);       \
+    register void *_current __asm__("rsi") = (current)
+
+ #define _GREEN_INLINE_DEACTIVATE               \
+    "movq   -8(%[thread]), %%rdx    \n\t"       \
+    "movq   %%rdx, (%[current])     \n\t"       \
+    "movq   %[thread], -8(%[thread])\n\t"
+
+#elif defined(__aarch64__)
+
+ #define _GREEN_INLINE_LAST_ACTIVE(thread)  (((green_thread_t *)(thread))[0])
+
+ /*
+  * Unlike green.aarch64.s, only fp and the return address
+  * are actually saved in the switch frame;
+  * the slots for x19-x28 are left as garbage
+  * and those registers are clobbered instead.
+  */
+ #define _GREEN_INLINE_SWITCH_OUT               \
+    "adr    x9, 1f                  \n\t"       \
+    "stp    x29, x9, [sp, #-16]!    \n\t"       \
+    "sub    sp, sp, #80             \n\t"       \
+    "ldr    x10, [%[thread], #32]   \n\t"       \
+    "mov    x11, sp                 \n\t"       \
+    "str    x11, [%[thread], #32]   \n\t"       \
+    "mov    sp, x10                 \n\t"
+
+ #define _GREEN_INLINE_SWITCH_IN                \
+    "ldp    x19, x20, [sp], #16     \n\t"       \
+    "ldp    x21, x22, [sp], #16     \n\t"       \
+    "ldp    x23, x24, [sp], #16     \n\t"       \
+    "ldp    x25, x26, [sp], #16     \n\t"       \
+    "ldp    x27, x28, [sp], #16     \n\t"       \
+    "ldp    x29, x30, [sp], #16     \n\t"       \
+    "ret                            \n"         \
+    "1:                             \n\t"
+
+ #define _GREEN_INLINE_CLOBBER                                          \
+    "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12",      \
+    "x13", "x14", "x15", "x16", "x17", "x19", "x20", "x21", "x22",      \
+    "x23", "x24", "x25", "x26", "x27", "x28", "x30",                    \
+    "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7",                     \
+    "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15",               \
+    "v16", "v17", "v18", "v19", "v20", "v21", "v22", "v23",             \
+    "v24", "v25", "v26", "v27", "v28", "v29", "v30", "v31",             \
+    "cc", "memory"
+
+ #define _GREEN_INLINE_REGS(value, thread, current)         \
+    register void *_value __asm__("x0") = (value);          \
+    register void *_thread __asm__("x1") = (thread);        \
+    register void *_current __asm__("x2") = (current)
+
+ #define _GREEN_INLINE_DEACTIVATE               \
+    "ldr    x10, [%[thread]]        \n\t"       \
+    "str    x10, [%[current]]       \n\t"       \
+    "stlr   %[thread], [%[thread]]  \n\t"
+
+#else
+ #error unsupported target architecture
+#endif
+
+
+/**
+ * Inlinable version of \ref green_resume.
+ *
+ * Behaves exactly as \ref green_resume does.
+ */
+static inline green_await_t
+green_resume_inline(green_thread_t thread, green_resume_t resume_with)
+{
+    green_thread_t *current = &_green_active;
+    green_thread_t expect = thread;
+
+    if (!__atomic_compare_exchange_n(
+        &_GREEN_INLINE_LAST_ACTIVE(thread), &expect, *current,
+        0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED
+    )) {
+        return GREEN_RESUME_FAILED;
+    }
+
+    *current = thread;
+    _green_switches += 1;
+
+    _GREEN_INLINE_REGS(resume_with, thread, current);
+    __asm__ volatile (
+        _GREEN_INLINE_SWITCH_OUT
+        _GREEN_INLINE_SWITCH_IN
+        : "+r" (_value), [thread] "+r" (_thread), [current] "+r" (_current)
+        :
+        : _GREEN_INLINE_CLOBBER
+    );
+
+    return (green_await_t)_value;
+}
+
+/**
+ * Inlinable version of \ref green_await.
+ *
+ * Behaves exactly as \ref green_await does.
+ * Awaiting `NULL` is passed on to \ref green_await.
+ */
+static inline green_resume_t
+green_await_inline(green_await_t wait_for)
+{
+    green_thread_t *current = &_green_active;
+    green_thread_t thread = *current;
+
+    if (thread == NULL)
+        return GREEN_AWAIT_FAILED;
+    else if (wait_for == NULL)
+        return green_await(wait_for);
+
+    _GREEN_INLINE_REGS(wait_for, thread, current);
+    __asm__ volatile (
+        _GREEN_INLINE_SWITCH_OUT
+        _GREEN_INLINE_DEACTIVATE
+        _GREEN_INLINE_SWITCH_IN
+        : "+r" (_value), [thread] "+r" (_thread), [current] "+r" (_current)
+        :
+        : _GREEN_INLINE_CLOBBER
+    );
+
+    return (green_resume_t)_value;
+}
+
+
+#undef _GREEN_INLINE_LAST_ACTIVE
+#undef _GREEN_INLINE_SWITCH_OUT
+#undef _GREEN_INLINE_SWITCH_IN
+#undef _GREEN_INLINE_CLOBBER_AVX512
+#undef _GREEN_INLINE_CLOBBER
+#undef _GREEN_INLINE_REGS
+#undef _GREEN_INLINE_DEACTIVATE
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // include guard
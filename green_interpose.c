@@ -0,0 +1,271 @@
+/* This file is part of https://github.com/NelsonCrosby/green.c */
+/* BSD 2-Clause License                                                      *
+ *                                                                           *
+ * Copyright (c) 2020, Nelson Crosby <nelson@tika.to>                        *
+ * All rights reserved.                                                      *
+ *                                                                           *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Optional wrappers that make blocking calls wait through green_poll
+ * when they are made from inside a coroutine
+ * on a pthread that has a hook installed (see green_set_poll).
+ * Everywhere else, the real call is made unchanged.
+ *
+ * By default, this is meant to be linked in with
+ *
+ *     -Wl,--wrap=read,--wrap=write,--wrap=connect,--wrap=poll,--wrap=nanosleep
+ *
+ * Alternatively, build it with -DGREEN_INTERPOSE_PRELOAD
+ * as a shared library for LD_PRELOAD
+ * (in which case green.c must also be in a shared library,
+ *  or the program must be linked with -rdynamic).
+ *
+ * Descriptors that are already non-blocking are left alone,
+ * since whoever set that up is expecting EAGAIN.
+ *
+ * Reads and writes on sockets are tried straight away with MSG_DONTWAIT,
+ * so one that can go ahead costs no more than the real call;
+ * only one that would block pays to check the descriptor and wait.
+ * Other descriptors are checked with poll first,
+ * and are remembered as such so they skip the socket attempt next time.
+ */
+
+#define _GNU_SOURCE
+
+#include "green.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+
+#ifdef GREEN_INTERPOSE_PRELOAD
+ #include <dlfcn.h>
+
+ #define _WRAP(name) name
+ #define _REAL(name) (*_real_##name)
+
+static ssize_t (*_real_read)(int, void *, size_t);
+static ssize_t (*_real_write)(int, const void *, size_t);
+static int (*_real_connect)(int, const struct sockaddr *, socklen_t);
+static int (*_real_poll)(struct pollfd *, nfds_t, int);
+static int (*_real_nanosleep)(const struct timespec *, struct timespec *);
+
+static void __attribute__((constructor)) _interpose_init()
+{
+    _real_read = dlsym(RTLD_NEXT, "read");
+    _real_write = dlsym(RTLD_NEXT, "write");
+    _real_connect = dlsym(RTLD_NEXT, "connect");
+    _real_poll = dlsym(RTLD_NEXT, "poll");
+    _real_nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+}
+
+#else
+ #define _WRAP(name) __wrap_##name
+ #define _REAL(name) __real_##name
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+int __real_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int __real_nanosleep(const struct timespec *req, struct timespec *rem);
+
+#endif
+
+
+#define _FD_CACHE   1024
+#define _FD_BITS    (8 * sizeof(unsigned long))
+
+// Descriptors seen not to be sockets (a reused one just takes the slow path)
+static unsigned long _not_sockets[_FD_CACHE / _FD_BITS];
+
+static int _is_socket(int fd)
+{
+    return fd < 0 || fd >= _FD_CACHE || !(__atomic_load_n(
+        &_not_sockets[fd / _FD_BITS], __ATOMIC_RELAXED) & (1UL << (fd % _FD_BITS)));
+}
+
+static void _not_socket(int fd)
+{
+    if (fd >= 0 && fd < _FD_CACHE)
+        __atomic_fetch_or(&_not_sockets[fd / _FD_BITS],
+            1UL << (fd % _FD_BITS), __ATOMIC_RELAXED);
+}
+
+// The hook to wait with, if this pthread is in a coroutine that has one
+static green_poll_t _hook(void)
+{
+    return green_self() != NULL ? green_get_poll() : NULL;
+}
+
+/*
+ * Wait for fd after a call on it would have blocked,
+ * or fail with EAGAIN if it is non-blocking anyway.
+ */
+static int _wait_blocked(green_poll_t hook, int fd, short events)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0)
+        return -1;
+    else if (flags & O_NONBLOCK) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return hook(&pfd, 1, -1) < 0 ? -1 : 0;
+}
+
+/*
+ * Wait until fd is ready, if the call would otherwise block.
+ * Errors on fd itself are left for the real call to report.
+ */
+static int _wait_ready(green_poll_t hook, int fd, short events)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    int flags;
+
+    if (_REAL(poll)(&pfd, 1, 0) != 0)
+        return 0;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || flags & O_NONBLOCK)
+        return 0;
+
+    return hook(&pfd, 1, -1) < 0 ? -1 : 0;
+}
+
+
+ssize_t _WRAP(read)(int fd, void *buf, size_t count)
+{
+    green_poll_t hook = _hook();
+    ssize_t ret;
+
+    if (hook == NULL)
+        return _REAL(read)(fd, buf, count);
+
+    if (_is_socket(fd)) {
+        while ((ret = recv(fd, buf, count, MSG_DONTWAIT)) < 0
+               && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (_wait_blocked(hook, fd, POLLIN) != 0)
+                return -1;
+        }
+        if (ret >= 0 || errno != ENOTSOCK)
+            return ret;
+        _not_socket(fd);
+    }
+
+    if (_wait_ready(hook, fd, POLLIN) != 0)
+        return -1;
+    return _REAL(read)(fd, buf, count);
+}
+
+ssize_t _WRAP(write)(int fd, const void *buf, size_t count)
+{
+    green_poll_t hook = _hook();
+    ssize_t ret;
+
+    if (hook == NULL)
+        return _REAL(write)(fd, buf, count);
+
+    if (_is_socket(fd)) {
+        while ((ret = send(fd, buf, count, MSG_DONTWAIT)) < 0
+               && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (_wait_blocked(hook, fd, POLLOUT) != 0)
+                return -1;
+        }
+        if (ret >= 0 || errno != ENOTSOCK)
+            return ret;
+        _not_socket(fd);
+    }
+
+    if (_wait_ready(hook, fd, POLLOUT) != 0)
+        return -1;
+    return _REAL(write)(fd, buf, count);
+}
+
+int _WRAP(connect)(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    green_poll_t hook = _hook();
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    socklen_t errlen = sizeof(int);
+    int flags, ret, err;
+
+    if (hook == NULL || (flags = fcntl(fd, F_GETFL)) < 0 || flags & O_NONBLOCK)
+        return _REAL(connect)(fd, addr, addrlen);
+
+    // Connect in the background, and wait for it to finish
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    ret = _REAL(connect)(fd, addr, addrlen);
+    if (ret < 0 && errno == EINPROGRESS) {
+        ret = hook(&pfd, 1, -1) < 0 ? -1 :
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if (ret == 0 && err != 0) {
+            errno = err;
+            ret = -1;
+        }
+    }
+
+    err = errno;
+    fcntl(fd, F_SETFL, flags);
+    errno = err;
+    return ret;
+}
+
+int _WRAP(poll)(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    green_poll_t hook = _hook();
+    int ready;
+
+    if (hook == NULL || timeout == 0)
+        return _REAL(poll)(fds, nfds, timeout);
+    else if ((ready = _REAL(poll)(fds, nfds, 0)) != 0)
+        return ready;
+
+    return hook(fds, nfds, timeout);
+}
+
+int _WRAP(nanosleep)(const struct timespec *req, struct timespec *rem)
+{
+    green_poll_t hook = _hook();
+    long long ms;
+
+    if (hook == NULL || req->tv_sec < 0
+        || req->tv_nsec < 0 || req->tv_nsec >= 1000000000)
+    {
+        return _REAL(nanosleep)(req, rem);
+    }
+
+    ms = req->tv_sec * 1000LL + (req->tv_nsec + 999999) / 1000000;
+    if (hook(NULL, 0, ms > INT_MAX ? INT_MAX : (int)ms) < 0)
+        return -1;
+
+    if (rem != NULL)
+        *rem = (struct timespec){ 0, 0 };
+    return 0;
+}
@@ -0,0 +1,174 @@
+// C++ side of the test suite: green.hpp is header-only,
+// so it only gets compiled (and checked) here.
+// Each test returns NULL on success, or what went wrong;
+// test-green.c runs them alongside everything else.
+
+#include "green.hpp"
+
+#include <coroutine>
+
+extern "C" {
+const char *test_hpp_spawn();
+const char *test_hpp_join();
+const char *test_hpp_wait_direct();
+}
+
+
+namespace {
+
+struct counted {
+    int *alive;
+    explicit counted(int *alive) : alive(alive) { *alive += 1; }
+    counted(counted &&other) noexcept : alive(other.alive) { *alive += 1; }
+    ~counted() { *alive -= 1; }
+};
+
+// A stackless coroutine that starts straight away and is never awaited
+struct eager {
+    struct promise_type {
+        eager get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {}
+    };
+};
+
+// Suspends until the test resumes whoever awaited it
+struct trigger {
+    std::coroutine_handle<> waiter;
+    int value = 0;
+
+    auto operator co_await()
+    {
+        struct awaiter {
+            trigger &self;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) noexcept { self.waiter = h; }
+            int await_resume() const noexcept { return self.value; }
+        };
+        return awaiter{ *this };
+    }
+
+    void fire(int with)
+    {
+        value = with;
+        std::exchange(waiter, nullptr).resume();
+    }
+};
+
+eager join_waiter(green::coroutine<int> co, int *joined)
+{
+    co_await green::join(std::move(co), [](green_thread_t thread) {
+        green_resume(thread, nullptr);
+    });
+    *joined = 1;
+}
+
+} // namespace
+
+
+const char *test_hpp_spawn()
+{
+    int alive = 0, step = 0;
+
+    {
+        auto co = green::spawn<int, const char>(
+            [state = counted(&alive), &step](auto self) {
+                int answer = 42;
+                const char *reply = self.await(&answer);
+                step = reply != nullptr && *reply == 't' ? 2 : -1;
+            });
+
+        if (alive != 1)
+            return "callable was not moved onto the stack";
+
+        int *answer = co.resume();
+        if (answer == nullptr || *answer != 42)
+            return "typed await did not hand over its value";
+
+        if (co.resume("thanks") != nullptr || !co.done() || step != 2)
+            return "typed resume did not finish the coroutine";
+        if (alive != 0)
+            return "callable was not destroyed when it finished";
+    }
+
+    // Dropping a parked coroutine cancels it and destroys its callable
+    {
+        auto co = green::spawn<int>([state = counted(&alive)](auto self) {
+            int value = 1;
+            self.await(&value);
+        });
+        co.resume();
+    }
+    if (alive != 0)
+        return "cancelled callable was not destroyed";
+
+    // A running coroutine cannot be cancelled, so its handle is kept
+    {
+        green::coroutine<> co;
+        bool kept = false;
+        co = green::spawn([&co, &kept] {
+            kept = !co.reset() && errno == EBUSY && co;
+        });
+        co.resume();
+        if (!kept || !co.done())
+            return "resetting a running coroutine dropped its handle";
+
+        try {
+            co.resume();
+            return "resuming an empty handle did not throw";
+        } catch (const std::system_error &error) {
+            if (error.code().value() != ESRCH)
+                return "resuming an empty handle threw the wrong error";
+        }
+    }
+
+    // Dropping one that never started destroys its callable too
+    {
+        auto co = green::spawn([state = counted(&alive)] {});
+        auto moved = std::move(co);
+        if (co || !moved)
+            return "moving a handle did not move the coroutine";
+    }
+    if (alive != 0)
+        return "unstarted callable was not destroyed";
+
+    return nullptr;
+}
+
+const char *test_hpp_join()
+{
+    int joined = 0, ran = 0;
+
+    auto co = green::spawn<int>([&ran] { ran = 1; });
+    join_waiter(std::move(co), &joined);
+    if (!ran || !joined)
+        return "join did not resume the waiter when the coroutine finished";
+
+    return nullptr;
+}
+
+const char *test_hpp_wait_direct()
+{
+    trigger fire;
+    int got = 0;
+    int token;
+
+    auto co = green::spawn<int>([&] {
+        got = green::wait_direct(fire, reinterpret_cast<green_await_t>(&token));
+    });
+
+    if (co.resume() != &token || !fire.waiter)
+        return "wait_direct did not await while suspended";
+
+    // The coroutine finishes inside the wake, on this stack;
+    // its handle must find out rather than cancel a freed stack later
+    fire.fire(7);
+    if (got != 7)
+        return "wait_direct did not return the awaited value";
+    if (!co.done())
+        return "handle did not see its coroutine finish inside the wake";
+
+    return nullptr;
+}
@@ -1,4 +1,5 @@
 #include "green.h"
+#include "green_inline.h"
 
 #include <stdlib.h>
 #include <stdarg.h>
@@ -6,6 +7,13 @@
 #include <sys/types.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 
 
 enum test_result {
@@ -94,6 +102,33 @@ DECLTEST(test_bad_alloc, "spawn returns a sensible error when allocation was not
 DECLTEST(test_bad_resume, "coroutine cannot resume while already running");
 DECLTEST(test_bad_await, "cannot await from outside a coroutine");
 
+DECLTEST(test_bind, "coroutine stacks can be bound to a NUMA node");
+DECLTEST(test_cancel, "parked coroutines can be cancelled");
+DECLTEST(test_await_null, "awaiting NULL stops a coroutine early");
+DECLTEST(test_locals, "coroutine-local slots are kept per coroutine");
+DECLTEST(test_inline, "inline switches mix with out-of-line switches");
+DECLTEST(test_inline_finish, "coroutines finish cleanly under an inline resume");
+DECLTEST(test_generator, "generators hand over items in batches");
+DECLTEST(test_offload, "offloaded jobs hand coroutines back when done");
+DECLTEST(test_interpose, "blocking calls in coroutines wait through the poll hook");
+DECLTEST(test_sendfile, "sendfile and splice wait through the poll hook");
+DECLTEST(test_sched_order, "scheduler runs by priority, then deadline, then order");
+DECLTEST(test_sched_yield, "scheduler requeues yields and leaves parked coroutines");
+DECLTEST(test_preempt, "long-running coroutines yield once their slice is spent");
+DECLTEST(test_group, "groups join their children and cancel stragglers on failure");
+DECLTEST(test_select, "select wakes on the first event, from any pthread");
+DECLTEST(test_affinity, "coroutines stay on their scheduler until it is overloaded");
+DECLTEST(test_resume_many, "batched resumes behave like resuming one by one");
+DECLTEST(test_future, "futures hand one value to a parked coroutine");
+DECLTEST(test_inbox, "other pthreads wake an idle scheduler to resume coroutines");
+DECLTEST(test_spawn_args, "arguments can be copied onto the coroutine's own stack");
+DECLTEST(test_stack_classes, "stacks come from size classes and are reused clean");
+DECLTEST(test_mem_limit, "spawn is accounted and refused with EAGAIN over the limit");
+DECLTEST(test_watchdog, "watchdog reports a coroutine that stops switching");
+DECLTEST(test_resume_contention, "pthreads racing to resume a coroutine never share it");
+DECLTEST(test_deferred, "deferred spawns allocate nothing until first resumed");
+DECLTEST(test_hpp, "the C++ wrapper spawns, joins and waits on coroutines");
+
 int main()
 {
 
@@ -107,6 +142,32 @@ int main()
         &test_bad_alloc,
         &test_bad_resume,
         &test_bad_await,
+        &test_bind,
+        &test_cancel,
+        &test_await_null,
+        &test_locals,
+        &test_inline,
+        &test_inline_finish,
+        &test_generator,
+        &test_offload,
+        &test_interpose,
+        &test_sendfile,
+        &test_sched_order,
+        &test_sched_yield,
+        &test_preempt,
+        &test_group,
+        &test_select,
+        &test_affinity,
+        &test_resume_many,
+        &test_future,
+        &test_inbox,
+        &test_spawn_args,
+        &test_stack_classes,
+        &test_mem_limit,
+        &test_watchdog,
+        &test_resume_contention,
+        &test_deferred,
+        &test_hpp,
     };
     int n_tests = sizeof(tests) / sizeof(struct test *);
 
@@ -659,241 +720,2616 @@ DEFTEST(test_bad_await)
 }
 
 
-#if defined(__x86_64__)
-    asm(
-        "   .text                   \n"
+static void bind_start(void *arguments)
+{
+    struct test_args *args = arguments;
+    struct gaio_await awon = { 0 };
 
-        ".macro _sprot              \n"
-#ifdef _GREEN_EXPORT_INTERNALS
-        "   call    _green_current  \n"
-        "   movq    (%rax), %rax    \n"
-        "   cmpq    $0, %rax        \n"
-        "   jne     1f              \n"
-        "   call    _root_stack     \n"
-        "   movq    _root_stack_size(%rip), %rcx    \n"
-        "   jmp     2f              \n"
-        "1:                         \n"
-        "   movq    -40(%rax), %rcx \n"
-        "2:                         \n"
-        "   cmpq    %rax, %rsp      \n"
-        "   jge     2f              \n"
-        "   subq    %rcx, %rax      \n"
-        "   cmpq    %rax, %rsp      \n"
-        "   jge     1f              \n"
-        "   addq    %rcx, %rax      \n"
-        "2:                         \n"
-        "   movq    %rsp, %rdi      \n"
-        "   movq    %rax, %rsi      \n"
-        "   call    _BAIL_ACTV      \n"
-        "1:                         \n"
-#endif
-        "   pushq   %rbp            \n"
-        "   pushq   %rbx            \n"
-        "   pushq   %r12            \n"
-        "   pushq   %r13            \n"
-        "   pushq   %r14            \n"
-        "   pushq   %r15            \n"
-        "   movq    $32, %rcx       \n"
-        "1:                         \n"
-        "   pushq   %rbp            \n"
-        "   loop    1b              \n"
-        ".endm                      \n"
+    if (green_bind(*_green_current(), -1) == 0) {
+        D("bound a running thread");
+        return;
+    } else if (errno != EBUSY) {
+        D("errno should have been EBUSY, got: %s", strerror(errno));
+        return;
+    }
 
-        ".macro _stest              \n"
-        "   movq    $32, %rcx       \n"
-        "1:                         \n"
-        "   popq    %rdx            \n"
-        "   cmpq    %rdx, %rbp      \n"
-        "   loope   1b              \n"
-        "   je      1f              \n"
-        "   movq    %rsp, %rdi      \n"
-        "   addq    $32, %rdi       \n"
-        "   subq    %rcx, %rdi      \n"
-        "   movq    %rcx, %rsi      \n"
-        "   movq    %rbp, %rcx      \n"
-        "   call    _BAIL_BUFR      \n"
-        "1:                         \n"
-        "   movq    $6, %rsi        \n"
-        "   popq    %rdx            \n"
-        "   subq    $1, %rsi        \n"
-        "   movq    %r15, %rcx      \n"
-        "   cmpq    %rdx, %rcx      \n"
-        "   jne     2f              \n"
-        "   popq    %rdx            \n"
-        "   subq    $1, %rsi        \n"
-        "   movq    %r14, %rcx      \n"
-        "   cmpq    %rdx, %rcx      \n"
-        "   jne     2f              \n"
-        "   popq    %rdx            \n"
-        "   subq    $1, %rsi        \n"
-        "   movq    %r13, %rcx      \n"
-        "   cmpq    %rdx, %rcx      \n"
-        "   jne     2f              \n"
-        "   popq    %rdx            \n"
-        "   subq    $1, %rsi        \n"
-        "   movq    %r12, %rcx      \n"
-        "   cmpq    %rdx, %rcx      \n"
-        "   jne     2f              \n"
-        "   popq    %rdx            \n"
-        "   subq    $1, %rsi        \n"
-        "   movq    %rbx, %rcx      \n"
-        "   cmpq    %rdx, %rcx      \n"
-        "   jne     2f              \n"
-        "   popq    %rdx            \n"
-        "   subq    $1, %rsi        \n"
-        "   movq    %rbp, %rcx      \n"
-        "   cmpq    %rdx, %rcx      \n"
-        "   je      1f              \n"
-        "2:                         \n"
-        "   movq    %rsp, %rdi      \n"
-        "   addq    $6, %rdi        \n"
-        "   subq    %rdx, %rdi      \n"
-        "   call    _BAIL_STOR      \n"
-        "1:                         \n"
-        ".endm                      \n"
+    args->did_run = 1;
+    green_await_sp(&awon);
+}
 
-        "_test_green__spawn_sp:     \n"
-        "   pushq   %r12            \n"
-        "   pushq   %r13            \n"
-        "   pushq   %r14            \n"
-        "   pushq   %r15            \n"
-        "   leaq    _test_green__spawn_sp(%rip), %r15   \n"
-        "   movq    %rdi, %r14      \n"
-        "   movq    %rsi, %r13      \n"
-        "   movq    %rdx, %r12      \n"
-        "   _sprot                  \n"
-        "   call    green_spawn     \n"
-        "   _stest                  \n"
-        "   popq    %r15            \n"
-        "   popq    %r14            \n"
-        "   popq    %r13            \n"
-        "   popq    %r12            \n"
-        "   ret                     \n"
+// Report the NUMA policy of the page this coroutine's stack is on
+static void bind_policy_start(void *arguments)
+{
+    int *mode = arguments;
+    if (syscall(SYS_get_mempolicy, mode, NULL, 0, &mode, 2 /* MPOL_F_ADDR */) != 0)
+        *mode = -1;
+}
 
-        "_test_green__await_sp:     \n"
-        "   pushq   %r14            \n"
-        "   pushq   %r15            \n"
-        "   leaq    _test_green__await_sp(%rip), %r15   \n"
-        "   movq    %rdi, %r14      \n"
-        "   _sprot                  \n"
-        "   call    green_await     \n"
-        "   _stest                  \n"
-        "   popq    %r15            \n"
-        "   popq    %r14            \n"
-        "   ret                     \n"
+DEFTEST(test_bind)
+{
+    green_thread_t co;
+    green_await_t awon;
+    struct test_args args = { 0 };
 
-        "_test_green__resume_sp:    \n"
-        "   pushq   %r13            \n"
-        "   pushq   %r14            \n"
-        "   pushq   %r15            \n"
-        "   leaq    _test_green__resume_sp(%rip), %r15  \n"
-        "   movq    %rdi, %r14      \n"
-        "   movq    %rsi, %r13      \n"
-        "   _sprot                  \n"
-        "   call    green_resume    \n"
-        "   _stest                  \n"
-        "   popq    %r15            \n"
-        "   popq    %r14            \n"
-        "   popq    %r13            \n"
-        "   ret                     \n"
-    );
+    co = green_spawn_sp(bind_start, &args, 0);
+    if (co == NULL) {
+        D("thread not created: %s", strerror(errno));
+        return FAIL;
+    }
 
-#elif defined(__aarch64__)
-    asm(
-        "   .text                           \n"
+    if (green_bind(co, -1) != 0) {
+        D("could not bind new thread: %s", strerror(errno));
+        return FAIL;
+    }
 
-        ".macro _sprot                      \n"
-#ifdef _GREEN_EXPORT_INTERNALS
-        "   bl      _green_current          \n"
-        "   ldr     x0, [x0]                \n"
-        "   cmp     x0, #0                  \n"
-        "   bne     1f                      \n"
-        "   bl      _root_stack             \n"
-        "   ldr     x1, _root_stack_size    \n"
-        "   b       2f                      \n"
-        "1:                                 \n"
-        "   ldr     x1, [x0, #8]            \n"
-        "2:                                 \n"
-        "   cmp     sp, x0                  \n"
-        "   bge     2f                      \n"
-        "   sub     x0, x0, x1              \n"
-        "   cmp     sp, x0                  \n"
-        "   bge     1f                      \n"
-        "   add     x0, x0, x1              \n"
-        "2:                                 \n"
-        "   mov     x0, x1                  \n"
-        "   mov     sp, x0                  \n"
-        "   bl      _BAIL_ACTV              \n"
-        "1:                                 \n"
-#endif
-        "   mov     x6, sp                  \n"
-        "   stp     x29, x6, [sp, #-16]!    \n"
-        "   stp     x27, x28, [sp, #-16]!   \n"
-        "   stp     x25, x26, [sp, #-16]!   \n"
-        "   stp     x23, x24, [sp, #-16]!   \n"
-        "   stp     x21, x22, [sp, #-16]!   \n"
-        "   stp     x19, x20, [sp, #-16]!   \n"
-        "   sub     x1, sp, #(32*8)         \n"
-        "1:                                 \n"
-        "   stp     x29, x29, [sp, #-16]!   \n"
-        "   cmp     sp, x1                  \n"
-        "   bne     1b                      \n"
-        ".endm                              \n"
+    awon = green_resume_sp(co, NULL);
+    if (awon == GREEN_RESUME_FAILED) {
+        D("resume failed");
+        return FAIL;
+    } else if (awon == NULL) {
+        D("thread returned early");
+        return FAIL;
+    } else if (args.did_run != 1) {
+        D("thread did not run");
+        return FAIL;
+    }
 
-        ".macro _stest                      \n"
-        "   mov     x6, sp                  \n"
-        "   mov     x1, #31                 \n"
-        "   mov     x3, x29                 \n"
-        "1:                                 \n"
-        "   ldr     x2, [x6, x1, lsl #3]    \n"
-        "   cmp     x2, x3                  \n"
-        "   bne     2f                      \n"
-        "   subs    x1, x1, #1              \n"
-        "   bpl     1b                      \n"
-        "   add     x6, x6, #(32*8)         \n"
-        "   b       1f                      \n"
-        "2:                                 \n"
-        "   mov     x0, x6                  \n"
-        "   mov     x5, #31                 \n"
-        "   sub     x1, x5, x1              \n"
-        "   mov     x3, x29                 \n"
-        "   bl      _BAIL_BUFR              \n"
-        "1:                                 \n"
-        "   ldr     x2, [x6], #8            \n"
-        "   cmp     x2, x19                 \n"
-        "   csel    x3, x19, x3, ne         \n"
-        "   bne     2f                      \n"
-        "   ldr     x2, [x6], #8            \n"
-        "   cmp     x2, x20                 \n"
-        "   csel    x3, x20, x3, ne         \n"
-        "   bne     2f                      \n"
-        "   ldr     x2, [x6], #8            \n"
-        "   cmp     x2, x21                 \n"
-        "   csel    x3, x21, x3, ne         \n"
-        "   bne     2f                      \n"
-        "   ldr     x2, [x6], #8            \n"
-        "   cmp     x2, x22                 \n"
-        "   csel    x3, x22, x3, ne         \n"
-        "   bne     2f                      \n"
-        "   ldr     x2, [x6], #8            \n"
-        "   cmp     x2, x23                 \n"
-        "   csel    x3, x23, x3, ne         \n"
-        "   bne     2f                      \n"
-        "   ldr     x2, [x6], #8            \n"
-        "   cmp     x2, x24                 \n"
-        "   csel    x3, x24, x3, ne         \n"
-        "   bne     2f                      \n"
-        "   ldr     x2, [x6], #8            \n"
-        "   cmp     x2, x25                 \n"
-        "   csel    x3, x25, x3, ne         \n"
-        "   bne     2f                      \n"
-        "   ldr     x2, [x6], #8            \n"
-        "   cmp     x2, x26                 \n"
-        "   csel    x3, x26, x3, ne         \n"
-        "   bne     2f                      \n"
-        "   ldr     x2, [x6], #8            \n"
-        "   cmp     x2, x27                 \n"
-        "   csel    x3, x27, x3, ne         \n"
+    if (green_bind(co, -1) != 0) {
+        D("could not bind parked thread: %s", strerror(errno));
+        return FAIL;
+    }
+
+    struct gaio_resume resinfo = { 0 };
+    awon = green_resume_sp(co, &resinfo);
+    if (awon != NULL) {
+        D("thread did not finish");
+        return FAIL;
+    }
+
+    // The next coroutine to get that stack is not bound with it
+    int mode = -1;
+    green_thread_t reused = green_spawn_sp(bind_policy_start, &mode, 0);
+    if (reused != co)
+        D("stack was not reused, so its binding could not be checked");
+    green_resume_sp(reused, NULL);
+    if (reused == co && mode != 0 /* MPOL_DEFAULT */) {
+        D("reused stack kept NUMA policy %d", mode);
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+static void cancel_cleanup(void *arg)
+{
+    *(int *)arg += 1;
+}
+
+static void cancel_start(void *arguments)
+{
+    struct test_args *args = arguments;
+    struct green_cleanup cleanup;
+    struct gaio_await awon = { 0 };
+
+    green_cleanup_push(&cleanup, cancel_cleanup, &args->did_run);
+    if (green_await_sp(&awon) == NULL) {
+        green_await_sp(NULL);
+        D("await NULL returned");
+    }
+    green_cleanup_pop(0);
+}
+
+DEFTEST(test_cancel)
+{
+    green_thread_t co;
+    green_await_t awon;
+    struct test_args args = { 0 };
+
+    co = green_spawn_sp(cancel_start, &args, 0);
+    if (co == NULL) {
+        D("thread not created: %s", strerror(errno));
+        return FAIL;
+    }
+
+    awon = green_resume_sp(co, NULL);
+    if (awon == GREEN_RESUME_FAILED || awon == NULL) {
+        D("thread did not await");
+        return FAIL;
+    }
+
+    if (green_cancel(co) != 0) {
+        D("cancel failed: %s", strerror(errno));
+        return FAIL;
+    } else if (args.did_run != 1) {
+        D("cleanup ran %d times (expect 1)", args.did_run);
+        return FAIL;
+    }
+
+    co = green_spawn_sp(cancel_start, &args, 0);
+    if (co == NULL) {
+        D("thread not created: %s", strerror(errno));
+        return FAIL;
+    } else if (green_cancel(co) != 0) {
+        D("cancel before start failed: %s", strerror(errno));
+        return FAIL;
+    } else if (args.did_run != 1) {
+        D("cleanup ran before thread started");
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+DEFTEST(test_await_null)
+{
+    green_thread_t co;
+    green_await_t awon;
+    struct test_args args = { 0 };
+
+    co = green_spawn_sp(cancel_start, &args, 0);
+    if (co == NULL) {
+        D("thread not created: %s", strerror(errno));
+        return FAIL;
+    }
+
+    awon = green_resume_sp(co, NULL);
+    if (awon == GREEN_RESUME_FAILED || awon == NULL) {
+        D("thread did not await");
+        return FAIL;
+    }
+
+    awon = green_resume_sp(co, NULL);
+    if (awon != NULL) {
+        D("thread did not stop");
+        return FAIL;
+    } else if (args.did_run != 1) {
+        D("cleanup ran %d times (expect 1)", args.did_run);
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+static int locals_key;
+
+static void locals_start(void *arguments)
+{
+    struct test_args *args = arguments;
+    struct gaio_await awon = { 0 };
+
+    if (green_local_get(locals_key) != NULL) {
+        D("local did not start as NULL");
+        return;
+    }
+
+    green_local_set(locals_key, args);
+    green_await_sp(&awon);
+    if (green_local_get(locals_key) != args) {
+        D("local changed while awaiting");
+        return;
+    }
+
+    args->did_run = 1;
+}
+
+DEFTEST(test_locals)
+{
+    green_thread_t co[2];
+    struct test_args args[2] = { { 0 }, { 0 } };
+    struct gaio_resume resinfo = { 0 };
+    int root_value;
+
+    locals_key = green_local_key();
+    if (locals_key < 0) {
+        D("could not reserve a key: %s", strerror(errno));
+        return FAIL;
+    }
+
+    green_local_set(locals_key, &root_value);
+
+    for (int i = 0; i < 2; i += 1) {
+        co[i] = green_spawn_sp(locals_start, &args[i], 0);
+        if (co[i] == NULL) {
+            D("thread %d not created: %s", i, strerror(errno));
+            return FAIL;
+        } else if (green_resume_sp(co[i], NULL) == NULL) {
+            D("thread %d returned early", i);
+            return FAIL;
+        }
+    }
+
+    for (int i = 0; i < 2; i += 1) {
+        if (green_resume_sp(co[i], &resinfo) != NULL) {
+            D("thread %d did not finish", i);
+            return FAIL;
+        } else if (args[i].did_run != 1) {
+            D("thread %d saw the wrong local", i);
+            return FAIL;
+        }
+    }
+
+    if (green_local_get(locals_key) != &root_value) {
+        D("root stack local was overwritten");
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+static void inline_start(void *arguments)
+{
+    struct test_args *args = arguments;
+    struct gaio_await awon = { 0 };
+    green_resume_t next;
+    double scale = args->did_run * 0.5;
+
+    for (int i = 0; i < 64; i += 1) {
+        awon.id = i;
+        if (i % 3 == 0)
+            next = green_await_sp(&awon);
+        else
+            next = green_await_inline(&awon);
+
+        if (next == GREEN_AWAIT_FAILED) {
+            D("await %d failed", i);
+            return;
+        } else if (next->id != i * 2) {
+            D("await %d resumed with %d", i, next->id);
+            return;
+        }
+    }
+
+    args->did_run = (int)(scale * 4);
+}
+
+DEFTEST(test_inline)
+{
+    green_thread_t co;
+    green_await_t awon;
+    struct gaio_resume resinfo;
+    struct test_args args = { 3 };
+    long live = 0x5eed;
+
+    co = green_spawn_sp(inline_start, &args, 0);
+    if (co == NULL) {
+        D("thread not created: %s", strerror(errno));
+        return FAIL;
+    }
+
+    awon = green_resume_inline(co, NULL);
+    for (int i = 0; awon != NULL; i += 1) {
+        if (awon == GREEN_RESUME_FAILED) {
+            D("resume %d failed", i);
+            return FAIL;
+        } else if (awon->id != i) {
+            D("resume %d got await %d", i, awon->id);
+            return FAIL;
+        }
+
+        resinfo.id = awon->id * 2;
+        live += awon->id;
+        if (i % 2 == 0)
+            awon = green_resume_inline(co, &resinfo);
+        else
+            awon = green_resume_sp(co, &resinfo);
+    }
+
+    if (args.did_run != 6) {
+        D("thread did not finish properly (got %d)", args.did_run);
+        return FAIL;
+    } else if (live != 0x5eed + 63 * 64 / 2) {
+        D("live value was clobbered");
+        return FAIL;
+    } else if (green_await_inline((green_await_t)&args) != GREEN_AWAIT_FAILED) {
+        D("inline await outside of a coroutine succeeded");
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+static void inline_finish_cleanup(void *arguments)
+{
+    struct test_args *args = arguments;
+
+    // Cleanups run in a call from the finishing coroutine,
+    // on the resumer's stack; SSE spills there need 16 bytes
+    args->did_run = ((uintptr_t)__builtin_frame_address(0) & 15) == 0;
+}
+
+static void inline_finish_start(void *arguments)
+{
+    struct test_args *args = arguments;
+    struct green_cleanup cleanup;
+
+    green_cleanup_push(&cleanup, inline_finish_cleanup, args);
+    if (args->did_run)
+        green_await_inline(NULL);
+}
+
+green_await_t inline_finish_leaf(green_thread_t co);
+green_await_t inline_finish_skewed(green_thread_t co);
+
+__attribute__((noinline)) green_await_t inline_finish_leaf(green_thread_t co)
+{
+    return green_resume_inline(co, NULL);
+}
+
+#if defined(__x86_64__)
+// Enters the leaf 8 bytes off, so the inline switch starts from
+// whichever stack alignment the compiler did not happen to pick
+__asm__(
+    ".text                              \n"
+    "inline_finish_skewed:              \n"
+    "   call    inline_finish_leaf      \n"
+    "   ret                             \n"
+);
+#else
+green_await_t inline_finish_skewed(green_thread_t co)
+{
+    return inline_finish_leaf(co);
+}
+#endif
+
+DEFTEST(test_inline_finish)
+{
+    // Finish by returning and by awaiting NULL, from either alignment
+    for (int i = 0; i < 4; i += 1) {
+        struct test_args args = { i & 1 };
+        green_thread_t co = green_spawn_sp(inline_finish_start, &args, 0);
+        green_await_t awon;
+
+        if (co == NULL) {
+            D("thread not created: %s", strerror(errno));
+            return FAIL;
+        }
+
+        awon = i & 2 ? inline_finish_skewed(co) : inline_finish_leaf(co);
+        if (awon != NULL) {
+            D("round %d: coroutine did not finish", i);
+            return FAIL;
+        } else if (args.did_run != 1) {
+            D("round %d: cleanup ran on a misaligned stack", i);
+            return FAIL;
+        }
+    }
+
+    return PASS;
+}
+
+
+static void generator_start(void *arguments)
+{
+    struct green_gen *gen = arguments;
+    int *limit = gen->arguments;
+
+    for (int i = 0; i < *limit; i += 1) {
+        if (green_gen_yield(gen, &i) != 0) {
+            D("yield %d failed: %s", i, strerror(errno));
+            return;
+        }
+    }
+}
+
+DEFTEST(test_generator)
+{
+    int buffer[8];
+    int limit = 100;
+    int *item;
+    size_t batches = 0;
+    struct green_gen gen = {
+        .buffer = buffer,
+        .item_size = sizeof(int),
+        .capacity = 8,
+        .arguments = &limit,
+    };
+
+    if (green_gen_start(&gen, generator_start, 0) != 0) {
+        D("generator not created: %s", strerror(errno));
+        return FAIL;
+    }
+
+    for (int i = 0; i < limit; i += 1) {
+        if (gen.next == gen.count)
+            batches += 1;
+
+        if ((item = green_gen_next(&gen)) == NULL) {
+            D("generator ended early at %d", i);
+            return FAIL;
+        } else if (*item != i) {
+            D("generator gave %d (expect %d)", *item, i);
+            return FAIL;
+        }
+    }
+
+    if (green_gen_next(&gen) != NULL) {
+        D("generator did not end");
+        return FAIL;
+    } else if (batches != (limit + 7) / 8) {
+        D("generator took %zu batches", batches);
+        return FAIL;
+    }
+
+    limit = 1000;
+    if (green_gen_start(&gen, generator_start, 0) != 0) {
+        D("generator not created: %s", strerror(errno));
+        return FAIL;
+    } else if (green_gen_fill(&gen) != 8) {
+        D("generator did not fill the buffer");
+        return FAIL;
+    }
+
+    green_gen_close(&gen);
+    if (green_gen_fill(&gen) != 8 - gen.next || !gen.done) {
+        D("generator did not close");
+        return FAIL;
+    }
+
+    // Outside a coroutine a full buffer cannot be handed over,
+    // and must not be written past
+    int one = 1;
+    buffer[1] = -1;
+    gen.count = 0;
+    gen.capacity = 1;
+    if (green_gen_yield(&gen, &one) != -1 || errno != EPERM) {
+        D("yield outside a coroutine did not fail with EPERM");
+        return FAIL;
+    } else if (green_gen_yield(&gen, &one) != -1 || errno != ENOBUFS
+        || gen.count != 1 || buffer[1] != -1) {
+        D("yield into a full buffer did not fail with ENOBUFS");
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+struct offload_args {
+    struct green_offload_pool *pool;
+    struct green_offload_queue *queue;
+    int value;
+};
+
+static void offload_job(void *arg)
+{
+    struct timespec delay = { 0, 1000000 };
+    nanosleep(&delay, NULL);
+    *(int *)arg += 1;
+}
+
+static void offload_start(void *arguments)
+{
+    struct offload_args *args = arguments;
+    int value = args->value;
+
+    if (green_offload(args->pool, args->queue, offload_job, &value) != 0) {
+        D("offload failed: %s", strerror(errno));
+        return;
+    }
+
+    args->value = value;
+}
+
+DEFTEST(test_offload)
+{
+    struct green_offload_pool *pool;
+    struct green_offload_queue queue;
+    struct offload_args args[4];
+    green_thread_t co;
+    green_await_t awon;
+    size_t running = 0;
+    enum test_result result = FAIL;
+
+    if ((pool = green_offload_pool_create(2)) == NULL) {
+        D("pool not created: %s", strerror(errno));
+        return FAIL;
+    } else if (green_offload_queue_init(&queue) != 0) {
+        D("queue not created: %s", strerror(errno));
+        green_offload_pool_destroy(pool);
+        return FAIL;
+    }
+
+    for (int i = 0; i < 4; i += 1) {
+        args[i] = (struct offload_args){ pool, &queue, i * 10 };
+        co = green_spawn_sp(offload_start, &args[i], 0);
+        if (co == NULL) {
+            D("thread %d not created: %s", i, strerror(errno));
+            goto out;
+        } else if (green_resume_sp(co, NULL) != GREEN_OFFLOADED) {
+            D("thread %d did not offload", i);
+            goto out;
+        }
+        running += 1;
+
+        // The helper may still be using the job on its stack
+        if (green_cancel(co) == 0 || errno != EBUSY) {
+            D("thread %d was cancelled with its job outstanding", i);
+            goto out;
+        }
+    }
+
+    while (running > 0) {
+        struct pollfd pfd = { queue.fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) != 1) {
+            D("timed out with %zu threads waiting", running);
+            goto out;
+        }
+
+        while ((co = green_offload_poll(&queue)) != NULL) {
+            awon = green_resume_sp(co, NULL);
+            if (awon != NULL) {
+                D("thread did not finish after offload");
+                goto out;
+            }
+            running -= 1;
+        }
+    }
+
+    result = PASS;
+    for (int i = 0; i < 4; i += 1) {
+        if (args[i].value != i * 10 + 1) {
+            D("thread %d got %d", i, args[i].value);
+            result = FAIL;
+        }
+    }
+
+out:
+    green_offload_pool_destroy(pool);
+    green_offload_queue_destroy(&queue);
+    return result;
+}
+
+
+#define POLL_HOOK_ID    0x9011
+
+static struct pollfd *poll_hook_fds;
+static nfds_t poll_hook_nfds;
+static int poll_hook_timeout;
+
+static int poll_hook(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    struct gaio_await awon = { POLL_HOOK_ID };
+
+    poll_hook_fds = fds;
+    poll_hook_nfds = nfds;
+    poll_hook_timeout = timeout;
+    if (green_await_sp(&awon) == GREEN_AWAIT_FAILED)
+        return -1;
+
+    return nfds == 0 ? 0 : poll(fds, nfds, 0);
+}
+
+static void interpose_start(void *arguments)
+{
+    int *fds = arguments;
+    char buffer[8] = { 0 };
+    struct timespec delay = { 5, 0 };
+
+    if (read(fds[0], buffer, sizeof(buffer)) != 4
+        || memcmp(buffer, "ping", 4) != 0)
+    {
+        D("read did not get the message");
+        return;
+    }
+
+    if (nanosleep(&delay, NULL) != 0) {
+        D("nanosleep failed: %s", strerror(errno));
+        return;
+    }
+
+    fds[0] = -1;
+}
+
+static void interpose_socket_start(void *arguments)
+{
+    int *socks = arguments;
+    char buffer[8] = { 0 };
+
+    // The first message is already there; the second has to be waited for
+    if (read(socks[0], buffer, sizeof(buffer)) != 3 || memcmp(buffer, "one", 3) != 0
+        || read(socks[0], buffer, sizeof(buffer)) != 3 || memcmp(buffer, "two", 3) != 0)
+    {
+        D("socket read did not get the messages");
+        return;
+    }
+
+    socks[0] = -1;
+}
+
+DEFTEST(test_interpose)
+{
+    green_thread_t co;
+    green_await_t awon;
+    int fds[2];
+    int read_fd;
+    enum test_result result = FAIL;
+
+    if (pipe(fds) != 0) {
+        D("pipe not created: %s", strerror(errno));
+        return FAIL;
+    }
+
+    read_fd = fds[0];
+    green_set_poll(poll_hook);
+
+    co = green_spawn_sp(interpose_start, fds, 0);
+    if (co == NULL) {
+        D("thread not created: %s", strerror(errno));
+        goto out;
+    }
+
+    awon = green_resume_sp(co, NULL);
+    if (awon == NULL || awon == GREEN_RESUME_FAILED || awon->id != POLL_HOOK_ID) {
+        D("read did not wait in the hook");
+        goto out;
+    } else if (poll_hook_nfds != 1 || poll_hook_fds[0].fd != read_fd
+               || poll_hook_fds[0].events != POLLIN)
+    {
+        D("read waited on the wrong thing");
+        goto out;
+    }
+
+    if (write(fds[1], "ping", 4) != 4) {
+        D("write failed: %s", strerror(errno));
+        goto out;
+    }
+
+    awon = green_resume_sp(co, NULL);
+    if (awon == NULL || awon == GREEN_RESUME_FAILED || awon->id != POLL_HOOK_ID) {
+        D("nanosleep did not wait in the hook");
+        goto out;
+    } else if (poll_hook_nfds != 0 || poll_hook_timeout != 5000) {
+        D("nanosleep waited for %d ms", poll_hook_timeout);
+        goto out;
+    }
+
+    awon = green_resume_sp(co, NULL);
+    if (awon != NULL) {
+        D("thread did not finish");
+        goto out;
+    } else if (fds[0] != -1) {
+        D("thread failed");
+        goto out;
+    }
+
+    // Outside a coroutine the real call is made, even with a hook
+    struct pollfd pfd = { read_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 10) != 0) {
+        D("poll outside a coroutine did not time out: %s", strerror(errno));
+        goto out;
+    }
+
+    int socks[2], read_sock;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) != 0) {
+        D("socket pair not created: %s", strerror(errno));
+        goto out;
+    }
+
+    read_sock = socks[0];
+    if (write(socks[1], "one", 3) != 3
+        || (co = green_spawn_sp(interpose_socket_start, socks, 0)) == NULL)
+    {
+        D("socket thread not set up: %s", strerror(errno));
+        goto out_socks;
+    }
+
+    awon = green_resume_sp(co, NULL);
+    if (awon == NULL || awon == GREEN_RESUME_FAILED || awon->id != POLL_HOOK_ID) {
+        D("socket read did not wait in the hook");
+        goto out_socks;
+    } else if (poll_hook_nfds != 1 || poll_hook_fds[0].fd != read_sock
+               || poll_hook_fds[0].events != POLLIN)
+    {
+        D("socket read waited on the wrong thing");
+        goto out_socks;
+    }
+
+    if (write(socks[1], "two", 3) != 3) {
+        D("write failed: %s", strerror(errno));
+        goto out_socks;
+    }
+
+    awon = green_resume_sp(co, NULL);
+    if (awon != NULL || socks[0] != -1) {
+        D("socket thread failed");
+        goto out_socks;
+    }
+
+    result = PASS;
+
+out_socks:
+    close(read_sock);
+    close(socks[1]);
+out:
+    green_set_poll(NULL);
+    close(read_fd);
+    close(fds[1]);
+    return result;
+}
+
+
+#define SENDFILE_SIZE   (1 << 20)
+
+struct sendfile_args {
+    int file;
+    int pipe;
+    int sock;
+    ssize_t sent;
+    ssize_t spliced;
+};
+
+static void sendfile_start(void *arguments)
+{
+    struct sendfile_args *args = arguments;
+    off_t offset = 0;
+
+    args->sent = green_sendfile(args->sock, args->file, &offset, SENDFILE_SIZE);
+    args->spliced = green_splice(args->pipe, NULL, args->sock, NULL, 4096, 0);
+}
+
+DEFTEST(test_sendfile)
+{
+    struct sendfile_args args = { -1, -1, -1, 0, 0 };
+    char path[] = "/tmp/test-green-XXXXXX";
+    static unsigned char buffer[SENDFILE_SIZE];
+    static unsigned char copy[SENDFILE_SIZE + 4096 + 1];
+    int socks[2] = { -1, -1 }, pipes[2] = { -1, -1 };
+    int sndbuf = 4096, waits = 0;
+    size_t received = 0;
+    ssize_t n;
+    green_thread_t co;
+    green_await_t awon;
+    enum test_result result = FAIL;
+
+    for (size_t i = 0; i < SENDFILE_SIZE; i += 1)
+        buffer[i] = i * 7;
+
+    if ((args.file = mkstemp(path)) < 0
+        || write(args.file, buffer, SENDFILE_SIZE) != SENDFILE_SIZE
+        || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, socks) != 0
+        || pipe(pipes) != 0 || write(pipes[1], buffer, 4096) != 4096)
+    {
+        D("setup failed: %s", strerror(errno));
+        goto out;
+    }
+
+    unlink(path);
+    setsockopt(socks[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    args.sock = socks[0];
+    args.pipe = pipes[0];
+    green_set_poll(poll_hook);
+
+    co = green_spawn_sp(sendfile_start, &args, 0);
+    if (co == NULL) {
+        D("thread not created: %s", strerror(errno));
+        goto out;
+    }
+
+    awon = green_resume_sp(co, NULL);
+    while (awon != NULL) {
+        if (awon == GREEN_RESUME_FAILED || awon->id != POLL_HOOK_ID) {
+            D("thread awaited something else");
+            goto out;
+        }
+
+        waits += 1;
+        while (received < sizeof(copy) && (n = read(
+            socks[1], copy + received, sizeof(copy) - received)) > 0)
+            received += n;
+        awon = green_resume_sp(co, NULL);
+    }
+
+    while (received < sizeof(copy) && (n = read(
+        socks[1], copy + received, sizeof(copy) - received)) > 0)
+        received += n;
+
+    if (args.sent != SENDFILE_SIZE || args.spliced != 4096) {
+        D("sent %zd and spliced %zd", args.sent, args.spliced);
+    } else if (received != SENDFILE_SIZE + 4096) {
+        D("received %zu bytes", received);
+    } else if (memcmp(copy, buffer, SENDFILE_SIZE) != 0
+               || memcmp(copy + SENDFILE_SIZE, buffer, 4096) != 0) {
+        D("received bytes do not match what was sent");
+    } else if (waits == 0) {
+        D("never had to wait for the socket");
+    } else {
+        result = PASS;
+    }
+
+out:
+    green_set_poll(NULL);
+    close(args.file);
+    close(socks[0]);
+    close(socks[1]);
+    close(pipes[0]);
+    close(pipes[1]);
+    return result;
+}
+
+
+struct sched_args {
+    int id;
+    int *order;
+    size_t *n_order;
+};
+
+static void sched_order_start(void *arguments)
+{
+    struct sched_args *args = arguments;
+    args->order[(*args->n_order)++] = args->id;
+}
+
+DEFTEST(test_sched_order)
+{
+    static const struct { int priority; unsigned long long deadline; } setup[] = {
+        { 1, 0 }, { 0, 0 }, { 0, 300 }, { 1, 5 }, { 0, 100 }, { 0, 0 }, { -1, 0 },
+    };
+    static const int expect[] = { 6, 4, 2, 1, 5, 3, 0 };
+    const size_t n = sizeof(setup) / sizeof(setup[0]);
+
+    struct green_sched sched;
+    struct sched_args args[sizeof(setup) / sizeof(setup[0])];
+    green_thread_t co[sizeof(setup) / sizeof(setup[0])];
+    int order[sizeof(setup) / sizeof(setup[0])];
+    size_t n_order = 0;
+
+    green_sched_init(&sched);
+    for (size_t i = 0; i < n; i += 1) {
+        args[i] = (struct sched_args){ i, order, &n_order };
+        co[i] = green_spawn_sp(sched_order_start, &args[i], 0);
+        if (co[i] == NULL) {
+            D("thread %zu not created: %s", i, strerror(errno));
+            return FAIL;
+        }
+
+        green_sched_priority(co[i], setup[i].priority);
+        green_sched_deadline(co[i], setup[i].deadline);
+        green_sched_ready(&sched, co[i], NULL);
+    }
+
+    // Cancelling a queued coroutine takes it off the queue
+    green_thread_t extra = green_spawn_sp(sched_order_start, &args[0], 0);
+    if (extra == NULL || green_sched_ready(&sched, extra, NULL) != 0) {
+        D("could not queue extra thread");
+        return FAIL;
+    } else if (green_sched_ready(&sched, extra, NULL) == 0) {
+        D("queued the same thread twice");
+        return FAIL;
+    } else if (green_cancel(extra) != 0) {
+        D("could not cancel extra thread");
+        return FAIL;
+    }
+
+    if (green_sched_run(&sched) != n) {
+        D("scheduler did not run every thread once");
+        return FAIL;
+    }
+
+    for (size_t i = 0; i < n; i += 1) {
+        if (order[i] != expect[i]) {
+            D("thread %d ran at %zu (expect %d)", order[i], i, expect[i]);
+            return FAIL;
+        }
+    }
+
+    return PASS;
+}
+
+static void sched_yield_start(void *arguments)
+{
+    struct sched_args *args = arguments;
+
+    for (int i = 0; i < 3; i += 1) {
+        args->order[(*args->n_order)++] = args->id;
+        green_sched_yield();
+    }
+
+    if (args->id == 0) {
+        green_sched_park();
+        args->order[(*args->n_order)++] = args->id;
+    }
+}
+
+static void sched_count_await(
+    struct green_sched *sched,
+    green_thread_t thread,
+    green_await_t awaited
+) {
+    (void)thread;
+    (void)awaited;
+    *(int *)sched->context += 1;
+}
+
+struct sched_self {
+    struct green_sched sched;
+    int awaits;
+    struct green_sched *home;
+};
+
+// Queue this coroutine, then try to run it from its own stack
+static void sched_self_start(void *arguments)
+{
+    struct sched_self *self = arguments;
+    green_sched_ready(&self->sched, green_self(), NULL);
+    green_sched_run(&self->sched);
+    self->home = green_affinity(green_self());
+}
+
+DEFTEST(test_sched_yield)
+{
+    static const int expect[] = { 0, 1, 0, 1, 0, 1 };
+    struct green_sched sched;
+    struct sched_args args[2];
+    green_thread_t co[2];
+    int order[8];
+    size_t n_order = 0;
+
+    green_sched_init(&sched);
+    for (int i = 0; i < 2; i += 1) {
+        args[i] = (struct sched_args){ i, order, &n_order };
+        co[i] = green_spawn_sp(sched_yield_start, &args[i], 0);
+        if (co[i] == NULL) {
+            D("thread %d not created: %s", i, strerror(errno));
+            return FAIL;
+        }
+        green_sched_ready(&sched, co[i], NULL);
+    }
+
+    green_sched_run(&sched);
+    if (n_order != 6) {
+        D("threads ran %zu times before parking (expect 6)", n_order);
+        return FAIL;
+    }
+
+    for (size_t i = 0; i < 6; i += 1) {
+        if (order[i] != expect[i]) {
+            D("thread %d ran at %zu (expect %d)", order[i], i, expect[i]);
+            return FAIL;
+        }
+    }
+
+    green_sched_ready(&sched, co[0], NULL);
+    if (green_sched_run(&sched) != 1 || n_order != 7) {
+        D("parked thread did not finish");
+        return FAIL;
+    }
+
+    // A failed resume is dropped, not handed to on_await,
+    // and does not move the coroutine to that scheduler
+    struct sched_self self = { .awaits = 0 };
+    green_sched_init(&self.sched);
+    self.sched.on_await = sched_count_await;
+    self.sched.context = &self.awaits;
+    green_resume_sp(green_spawn_sp(sched_self_start, &self, 0), NULL);
+    if (self.awaits != 0 || self.sched.ready != NULL) {
+        D("running coroutine was passed to on_await %d times", self.awaits);
+        return FAIL;
+    }
+    if (self.home != NULL) {
+        D("failed resume moved the coroutine to %p", (void *)self.home);
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+struct preempt_args {
+    volatile int other_ran;
+    int yields;
+    unsigned long overruns;
+};
+
+static void preempt_hog_start(void *arguments)
+{
+    struct preempt_args *args = arguments;
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        args->yields += green_maybe_yield();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (!args->other_ran && now.tv_sec - start.tv_sec < 2);
+
+    args->overruns = green_preempt_overruns(*_green_current());
+}
+
+static void preempt_other_start(void *arguments)
+{
+    struct preempt_args *args = arguments;
+    args->other_ran = 1;
+}
+
+// Busy-wait, so the preemption timer has a chance to tick
+static void preempt_spin(long ms)
+{
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do clock_gettime(CLOCK_MONOTONIC, &now);
+    while ((now.tv_sec - start.tv_sec) * 1000
+        + (now.tv_nsec - start.tv_nsec) / 1000000 < ms);
+}
+
+static void preempt_early_start(void *arguments)
+{
+    (void)arguments;
+    green_maybe_yield();
+}
+
+DEFTEST(test_preempt)
+{
+    struct green_sched sched;
+    struct preempt_args args = { 0, 0, 0 };
+    green_thread_t hog, other;
+    stack_t altstack;
+
+    if (green_preempt_start(1000) != 0) {
+        D("could not start time slicing: %s", strerror(errno));
+        return FAIL;
+    }
+
+    // Ticks land on whatever coroutine is running; they need their own stack
+    if (sigaltstack(NULL, &altstack) != 0 || (altstack.ss_flags & SS_DISABLE)) {
+        D("time slicing did not set up an alternate signal stack");
+        green_preempt_stop();
+        return FAIL;
+    }
+
+    green_sched_init(&sched);
+    hog = green_spawn_sp(preempt_hog_start, &args, 0);
+    other = green_spawn_sp(preempt_other_start, &args, 0);
+    if (hog == NULL || other == NULL) {
+        D("threads not created: %s", strerror(errno));
+        green_preempt_stop();
+        return FAIL;
+    }
+
+    green_sched_ready(&sched, hog, NULL);
+    green_sched_ready(&sched, other, NULL);
+    green_sched_run(&sched);
+    green_preempt_stop();
+
+    if (sigaltstack(NULL, &altstack) != 0 || !(altstack.ss_flags & SS_DISABLE)) {
+        D("alternate signal stack outlived time slicing");
+        return FAIL;
+    } else if (!args.other_ran) {
+        D("other thread never ran");
+        return FAIL;
+    } else if (args.yields == 0 || args.overruns != (unsigned long)args.yields) {
+        D("hog yielded %d times, with %lu overruns", args.yields, args.overruns);
+        return FAIL;
+    }
+
+    // A tick that lands just after a reset does not end the new slice
+    struct timespec start, now;
+    green_await_t awaited;
+    long elapsed;
+    if (green_preempt_start(50000) != 0) {
+        D("could not restart time slicing: %s", strerror(errno));
+        return FAIL;
+    }
+    preempt_spin(40);
+    green_preempt_reset();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    preempt_spin(20);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    hog = green_spawn_sp(preempt_early_start, NULL, 0);
+    awaited = green_resume_sp(hog, NULL);
+    green_preempt_stop();
+    if (awaited == GREEN_SCHED_YIELD)
+        green_resume_sp(hog, NULL);
+
+    elapsed = (now.tv_sec - start.tv_sec) * 1000000000L
+        + (now.tv_nsec - start.tv_nsec);
+    if (awaited != NULL && elapsed < 50000000L) {
+        D("slice ended %ld ns after it was reset", elapsed);
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+struct group_args {
+    struct green_group *group;
+    int yields;
+    int fail;
+    int *finished;
+    int *cancelled;
+};
+
+static void group_count_cancel(void *arg)
+{
+    *(int *)arg += 1;
+}
+
+static void group_child_start(void *arguments)
+{
+    struct group_args *args = arguments;
+    struct green_cleanup cleanup;
+
+    green_cleanup_push(&cleanup, group_count_cancel, args->cancelled);
+    for (int i = 0; i < args->yields; i += 1)
+        green_sched_yield();
+
+    if (args->fail) {
+        green_group_fail(args->group);
+        green_sched_park();
+    } else if (args->yields < 0) {
+        green_sched_park();
+    }
+
+    green_cleanup_pop(0);
+    *args->finished += 1;
+}
+
+struct group_parent {
+    int fail;
+    int result;
+    int error;
+    int finished;
+    int cancelled;
+};
+
+static void group_parent_start(void *arguments)
+{
+    struct group_parent *parent = arguments;
+    struct green_group group;
+    struct group_args args[3];
+
+    green_group_init(&group, green_sched_self());
+    for (int i = 0; i < 3; i += 1) {
+        args[i] = (struct group_args){
+            &group, i + 1, 0, &parent->finished, &parent->cancelled,
+        };
+        if (parent->fail && i == 1)
+            args[i].fail = 1;
+        if (parent->fail && i == 2)
+            args[i].yields = -1;
+        green_group_spawn(&group, group_child_start, &args[i], 0);
+    }
+
+    parent->result = green_group_wait(&group);
+    parent->error = errno;
+}
+
+struct group_nested {
+    struct green_group *group;
+    size_t pending;
+    int finished;
+};
+
+static void group_cancel_start(void *arguments)
+{
+    struct group_nested *nested = arguments;
+    green_group_cancel(nested->group);
+    nested->pending = nested->group->pending;
+}
+
+// Still running (resuming its own coroutine) when the group is cancelled
+static void group_resumer_start(void *arguments)
+{
+    struct group_nested *nested = arguments;
+    green_resume(green_spawn(group_cancel_start, nested, 0), NULL);
+    nested->finished = 1;
+}
+
+static void group_future_start(void *arguments)
+{
+    green_future_get(arguments);
+}
+
+DEFTEST(test_group)
+{
+    struct green_sched sched;
+    struct green_group group;
+    struct group_args args[2];
+    struct group_parent parent;
+    int finished = 0, cancelled = 0;
+
+    green_sched_init(&sched);
+    for (int fail = 0; fail < 2; fail += 1) {
+        parent = (struct group_parent){ fail, 1, 0, 0, 0 };
+        green_sched_ready(&sched, green_spawn(group_parent_start, &parent, 0), NULL);
+        green_sched_run(&sched);
+
+        if (!fail && (parent.result != 0 || parent.finished != 3)) {
+            D("group returned %d with %d finished (expect 0 with 3)",
+              parent.result, parent.finished);
+            return FAIL;
+        }
+
+        if (fail && (parent.result != -1 || parent.error != ECANCELED)) {
+            D("failed group returned %d: %s", parent.result, strerror(parent.error));
+            return FAIL;
+        }
+
+        if (fail && (parent.finished != 1 || parent.cancelled != 2)) {
+            D("failed group had %d finished and %d cancelled (expect 1 and 2)",
+              parent.finished, parent.cancelled);
+            return FAIL;
+        }
+
+        if (sched.n_ready != 0) {
+            D("%zu coroutines left queued", sched.n_ready);
+            return FAIL;
+        }
+    }
+
+    // Waiting outside of a coroutine runs the scheduler instead
+    green_group_init(&group, &sched);
+    for (int i = 0; i < 2; i += 1) {
+        args[i] = (struct group_args){ &group, i, 0, &finished, &cancelled };
+        green_group_spawn(&group, group_child_start, &args[i], 0);
+    }
+
+    if (green_group_wait(&group) != 0 || finished != 2) {
+        D("root wait returned with %d finished (expect 2)", finished);
+        return FAIL;
+    }
+
+    // A child that cannot be cancelled leaves the group instead
+    struct group_nested nested = { &group, 1, 0 };
+    green_group_init(&group, &sched);
+    green_group_spawn(&group, group_resumer_start, &nested, 0);
+    green_sched_run(&sched);
+    if (nested.pending != 0 || !nested.finished || group.children != NULL) {
+        D("running child was left in the cancelled group (%zu pending)",
+          nested.pending);
+        return FAIL;
+    }
+
+    // A child cancelled while it waits on a future stops waiting on it,
+    // so setting the future later does not touch the freed stack
+    struct green_future future;
+    struct green_mem_stats before, after;
+    green_mem_stats(&before);
+    green_future_init(&future);
+    green_group_init(&group, &sched);
+    green_group_spawn(&group, group_future_start, &future, 0);
+    green_sched_run(&sched);
+    green_group_cancel(&group);
+    green_mem_stats(&after);
+    if (after.live != before.live) {
+        D("cancelled child is still alive");
+        return FAIL;
+    }
+    green_future_set(&future, NULL);
+    if (!green_event_clear(&future.event)
+        || sched.n_ready != 0 || sched.remote != NULL) {
+        D("setting the future woke the cancelled child");
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+struct select_args {
+    struct green_event *events[3];
+    int picked[3];
+    int n_picked;
+    int empty_errno;
+};
+
+static void select_start(void *arguments)
+{
+    struct select_args *args = arguments;
+    if (green_select(args->events, 0) == -1)
+        args->empty_errno = errno;
+    while (args->n_picked < 3) {
+        int picked = green_select(args->events, 3);
+        args->picked[args->n_picked++] = picked;
+    }
+}
+
+struct select_late_args {
+    struct green_event *event;
+    int picked;
+    int woken;
+};
+
+static void select_late_start(void *arguments)
+{
+    struct select_late_args *args = arguments;
+
+    args->picked = green_select(&args->event, 1);
+    green_sched_park();
+    args->woken = 1;
+}
+
+static void select_setter_start(void *arguments)
+{
+    green_event_set(arguments);
+}
+
+static void *select_remote_start(void *arguments)
+{
+    struct timespec delay = { 0, 10 * 1000 * 1000 };
+    nanosleep(&delay, NULL);
+    green_event_set(arguments);
+    return NULL;
+}
+
+DEFTEST(test_select)
+{
+    static const int expect[] = { 0, 1, 2 };
+    struct green_sched sched;
+    struct green_event events[3];
+    struct select_args args = { 0 };
+    green_thread_t co;
+    pthread_t remote;
+
+    green_sched_init(&sched);
+    for (int i = 0; i < 3; i += 1) {
+        green_event_init(&events[i]);
+        args.events[i] = &events[i];
+    }
+
+    if (green_select(args.events, 3) != -1 || errno != EPERM) {
+        D("select outside of a coroutine did not fail with EPERM");
+        return FAIL;
+    }
+
+    // Already set, so the first select returns without parking
+    green_event_set(&events[0]);
+    co = green_spawn_sp(select_start, &args, 0);
+    green_sched_ready(&sched, co, NULL);
+    green_sched_run(&sched);
+    if (args.n_picked != 1) {
+        D("select returned %d times before parking (expect 1)", args.n_picked);
+        return FAIL;
+    }
+    if (args.empty_errno != EINVAL) {
+        D("select on no events did not fail with EINVAL");
+        return FAIL;
+    }
+
+    // Set by another coroutine on the same scheduler
+    green_sched_ready(&sched, green_spawn(select_setter_start, &events[1], 0), NULL);
+    green_sched_run(&sched);
+
+    // Set by another pthread while parked
+    if (pthread_create(&remote, NULL, select_remote_start, &events[2]) != 0) {
+        D("pthread_create failed");
+        return FAIL;
+    }
+    while (args.n_picked < 3)
+        green_sched_run(&sched);
+    pthread_join(remote, NULL);
+
+    for (int i = 0; i < 3; i += 1) {
+        if (args.picked[i] != expect[i]) {
+            D("select %d picked %d (expect %d)", i, args.picked[i], expect[i]);
+            return FAIL;
+        }
+        if (events[i].state != 0) {
+            D("event %d left registered or set", i);
+            return FAIL;
+        }
+    }
+
+    // Woken spuriously, then set (from off the scheduler) before it looks:
+    // the setter's wake must not resume the next park instead
+    struct select_late_args late = { &events[0], -1, 0 };
+    green_resume_t value;
+    co = green_spawn_sp(select_late_start, &late, 0);
+    green_sched_ready(&sched, co, NULL);
+    green_sched_run(&sched);
+    green_sched_ready(&sched, co, NULL);
+    green_sched_next(&sched, &value);
+    green_event_set(&events[0]);
+    green_resume_sp(co, value);
+    green_sched_run(&sched);
+    if (late.picked != 0 || late.woken) {
+        D("select picked %d, and its setter woke the next park: %d",
+          late.picked, late.woken);
+        return FAIL;
+    }
+    green_cancel(co);
+
+    return PASS;
+}
+
+
+static void affinity_start(void *arguments)
+{
+    (void)arguments;
+    for (;;)
+        green_sched_park();
+}
+
+DEFTEST(test_affinity)
+{
+    struct green_sched sched[2];
+    struct green_sched *scheds[2] = { &sched[0], &sched[1] };
+    green_thread_t co, filler[GREEN_MIGRATE_THRESHOLD + 1];
+    int result = PASS;
+
+    green_sched_init(&sched[0]);
+    green_sched_init(&sched[1]);
+    co = green_spawn_sp(affinity_start, NULL, 0);
+    for (int i = 0; i <= GREEN_MIGRATE_THRESHOLD; i += 1)
+        filler[i] = green_spawn_sp(affinity_start, NULL, 0);
+
+    if (green_affinity(co) != NULL) {
+        D("new coroutine already has a scheduler");
+        result = FAIL;
+        goto done;
+    }
+
+    // Scheduler 1 is idle, so a new coroutine goes there
+    green_sched_ready(&sched[0], filler[0], NULL);
+    if (green_sched_place(scheds, 2, co, NULL) != 1) {
+        D("new coroutine not placed on the idle scheduler");
+        result = FAIL;
+        goto done;
+    }
+    green_sched_run(&sched[1]);
+    if (green_affinity(co) != &sched[1]) {
+        D("coroutine does not belong to the scheduler that ran it");
+        result = FAIL;
+        goto done;
+    }
+
+    // Busier than scheduler 0, but not by enough to move
+    for (int i = 1; i <= GREEN_MIGRATE_THRESHOLD; i += 1)
+        green_sched_ready(&sched[1], filler[i], NULL);
+    if (green_sched_place(scheds, 2, co, NULL) != 1) {
+        D("coroutine moved away from a lightly loaded scheduler");
+        result = FAIL;
+        goto done;
+    }
+    green_sched_run(&sched[0]);
+    green_sched_run(&sched[1]);
+
+    // One more makes the imbalance too big
+    for (int i = 0; i <= GREEN_MIGRATE_THRESHOLD; i += 1)
+        green_sched_ready(&sched[1], filler[i], NULL);
+    if (green_sched_place(scheds, 2, co, NULL) != 0) {
+        D("coroutine not moved away from an overloaded scheduler");
+        result = FAIL;
+        goto done;
+    }
+    green_sched_run(&sched[0]);
+
+    // Unless it is pinned
+    green_migrate(co, &sched[1]);
+    green_pin(co, 1);
+    if (green_sched_place(scheds, 2, co, NULL) != 1) {
+        D("pinned coroutine moved");
+        result = FAIL;
+    }
+    green_sched_run(&sched[1]);
+
+done:
+    green_cancel(co);
+    for (int i = 0; i <= GREEN_MIGRATE_THRESHOLD; i += 1)
+        green_cancel(filler[i]);
+    return result;
+}
+
+
+static void resume_many_echo_start(void *arguments)
+{
+    green_resume_t value = green_await_sp(arguments);
+    green_await_sp((green_await_t)value);
+}
+
+struct resume_many_args {
+    green_thread_t other;
+    size_t count;
+    green_await_t out[2];
+};
+
+static void resume_many_self_start(void *arguments)
+{
+    struct resume_many_args *args = arguments;
+    green_thread_t threads[2] = { args->other, *_green_current() };
+    args->count = green_resume_many(threads, NULL, 2, args->out);
+}
+
+DEFTEST(test_resume_many)
+{
+    static int ids[4], values[4];
+    green_thread_t threads[4];
+    green_resume_t resume_with[4];
+    green_await_t out[4];
+    struct resume_many_args args;
+    green_thread_t co;
+
+    for (int i = 0; i < 4; i += 1) {
+        threads[i] = green_spawn_sp(resume_many_echo_start, &ids[i], 0);
+        resume_with[i] = (green_resume_t)&values[i];
+        if (threads[i] == NULL) {
+            D("thread %d not created: %s", i, strerror(errno));
+            return FAIL;
+        }
+    }
+
+    // Start, then hand each its value, then let each finish
+    for (int round = 0; round < 3; round += 1) {
+        if (green_resume_many(threads, resume_with, 4, out) != 4) {
+            D("not every coroutine was resumed in round %d", round);
+            return FAIL;
+        }
+
+        for (int i = 0; i < 4; i += 1) {
+            void *expect = round == 0 ? (void *)&ids[i]
+                : round == 1 ? (void *)&values[i] : NULL;
+            if ((void *)out[i] != expect) {
+                D("coroutine %d gave %p in round %d (expect %p)",
+                  i, (void *)out[i], round, expect);
+                return FAIL;
+            }
+        }
+    }
+
+    // Resuming the running coroutine fails without stopping the batch
+    args.other = green_spawn_sp(resume_many_echo_start, &ids[0], 0);
+    co = green_spawn_sp(resume_many_self_start, &args, 0);
+    green_resume_sp(co, NULL);
+    if (args.count != 1 || (void *)args.out[0] != &ids[0]
+        || args.out[1] != GREEN_RESUME_FAILED) {
+        D("resuming a batch including the caller resumed %zu", args.count);
+        return FAIL;
+    }
+
+    green_cancel(args.other);
+    return PASS;
+}
+
+
+struct future_args {
+    struct green_future *future;
+    int matched;
+};
+
+static void future_setter_start(void *arguments)
+{
+    struct future_args *args = arguments;
+    green_future_set(args->future, (green_resume_t)args);
+}
+
+static void future_getter_start(void *arguments)
+{
+    struct future_args *args = arguments;
+    struct green_future future;
+    struct future_args setter = { &future, 0 };
+
+    green_future_init(&future);
+    args->future = &future;
+    green_sched_ready(green_sched_self(),
+                      green_spawn(future_setter_start, &setter, 0), NULL);
+
+    args->matched = green_future_get(&future) == (green_resume_t)&setter;
+}
+
+DEFTEST(test_future)
+{
+    struct green_sched sched;
+    struct green_future future;
+    struct future_args args = { NULL, 0 };
+
+    green_future_init(&future);
+    if (green_future_get(&future) != GREEN_AWAIT_FAILED || errno != EPERM) {
+        D("waiting outside of a coroutine did not fail with EPERM");
+        return FAIL;
+    }
+
+    if (green_future_set(&future, (green_resume_t)&args) != 0
+        || green_future_set(&future, NULL) != -1 || errno != EALREADY) {
+        D("second set did not fail with EALREADY");
+        return FAIL;
+    }
+
+    if (!green_future_ready(&future)
+        || green_future_get(&future) != (green_resume_t)&args) {
+        D("ready future did not give back its value");
+        return FAIL;
+    }
+
+    green_sched_init(&sched);
+    green_sched_ready(&sched, green_spawn(future_getter_start, &args, 0), NULL);
+    if (green_sched_run(&sched) != 3) {
+        D("getter did not park exactly once");
+        return FAIL;
+    }
+
+    if (!args.matched) {
+        D("getter did not receive the setter's value");
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+struct inbox_worker {
+    struct green_sched sched;
+    pthread_t pthread;
+    pthread_t ran_on;
+    volatile int stop;
+    int resumed;
+    int woken;
+};
+
+static void inbox_start(void *arguments)
+{
+    struct inbox_worker *worker = arguments;
+    do {
+        worker->ran_on = pthread_self();
+        worker->resumed += 1;
+    } while (green_sched_park() == NULL);
+}
+
+static void *inbox_worker_start(void *arguments)
+{
+    struct inbox_worker *worker = arguments;
+    while (!worker->stop) {
+        green_sched_run(&worker->sched);
+        if (green_sched_wait(&worker->sched, NULL) == 0)
+            worker->woken += 1;
+    }
+
+    green_sched_run(&worker->sched);
+    return NULL;
+}
+
+DEFTEST(test_inbox)
+{
+    struct timespec timeout = { 0, 1000 * 1000 };
+    struct inbox_worker worker = { 0 };
+    struct green_sched_stats stats;
+    struct green_mem_stats before, after;
+    green_resume_t value;
+    green_thread_t co;
+
+    green_sched_init(&worker.sched);
+    if (green_sched_wait(&worker.sched, &timeout) != -1 || errno != ETIMEDOUT) {
+        D("waiting on an idle scheduler did not time out");
+        return FAIL;
+    }
+
+    // A wake sent before the wait is kept for it
+    green_sched_wake(&worker.sched);
+    if (green_sched_wait(&worker.sched, &timeout) != 0) {
+        D("wake sent before waiting was lost");
+        return FAIL;
+    }
+
+    co = green_spawn_sp(inbox_start, &worker, 0);
+    if (pthread_create(&worker.pthread, NULL, inbox_worker_start, &worker) != 0) {
+        D("pthread_create failed");
+        return FAIL;
+    }
+
+    for (int i = 0; i < 3; i += 1) {
+        struct timespec delay = { 0, 1000 * 1000 };
+        nanosleep(&delay, NULL);
+        while (green_sched_ready_remote(&worker.sched, co, NULL) != 0)
+            nanosleep(&delay, NULL);
+        while (__atomic_load_n(&worker.resumed, __ATOMIC_ACQUIRE) <= i)
+            nanosleep(&delay, NULL);
+    }
+
+    // Finish the coroutine, then stop the worker
+    green_sched_ready_remote(&worker.sched, co, (green_resume_t)&worker);
+    worker.stop = 1;
+    green_sched_wake(&worker.sched);
+    pthread_join(worker.pthread, NULL);
+
+    if (worker.resumed != 3 || !pthread_equal(worker.ran_on, worker.pthread)) {
+        D("coroutine resumed %d times, on the worker: %d (expect 3, yes)",
+          worker.resumed, pthread_equal(worker.ran_on, worker.pthread) != 0);
+        return FAIL;
+    }
+
+    if (worker.woken < 3) {
+        D("worker only woke %d times (expect at least 3)", worker.woken);
+        return FAIL;
+    }
+
+    green_sched_stats(&worker.sched, &stats);
+    if (stats.timeouts != 1 || stats.waits != stats.spin_hits + stats.sleeps
+        || stats.wakes > stats.sleeps) {
+        D("inconsistent stats: %llu waits, %llu spin hits, %llu sleeps, "
+          "%llu wakes, %llu timeouts", stats.waits, stats.spin_hits,
+          stats.sleeps, stats.wakes, stats.timeouts);
+        return FAIL;
+    }
+
+    // Without spinning, every wait sleeps
+    worker.sched.spin_limit = 0;
+    green_sched_wait(&worker.sched, &timeout);
+    green_sched_stats(&worker.sched, &stats);
+    if (stats.timeouts != 2 || stats.waits != stats.spin_hits + stats.sleeps) {
+        D("wait with spinning disabled did not go straight to sleep");
+        return FAIL;
+    }
+
+    // A remote post does not clobber the value of a local one
+    co = green_spawn_sp(inbox_start, &worker, 0);
+    green_sched_ready(&worker.sched, co, (green_resume_t)&worker);
+    green_sched_ready_remote(&worker.sched, co, (green_resume_t)&stats);
+    if (green_sched_next(&worker.sched, &value) != co || value != (green_resume_t)&worker
+        || green_sched_next(&worker.sched, &value) != NULL) {
+        D("remote post replaced the value of a local one");
+        return FAIL;
+    }
+
+    // ...but is not lost when the local one had nothing to say
+    green_sched_ready(&worker.sched, co, NULL);
+    green_sched_ready_remote(&worker.sched, co, (green_resume_t)&stats);
+    if (green_sched_next(&worker.sched, &value) != co || value != (green_resume_t)&stats
+        || green_sched_next(&worker.sched, &value) != NULL) {
+        D("remote post was dropped behind a local one");
+        return FAIL;
+    }
+
+    // Cancelled while still in the inbox, so the drain frees it
+    green_sched_ready_remote(&worker.sched, co, NULL);
+    green_mem_stats(&before);
+    green_cancel(co);
+    green_mem_stats(&after);
+    if (after.live != before.live) {
+        D("stack was freed while the inbox still pointed at it");
+        return FAIL;
+    }
+    if (green_sched_next(&worker.sched, &value) != NULL) {
+        D("cancelled coroutine was made ready");
+        return FAIL;
+    }
+    green_mem_stats(&after);
+    if (after.live != before.live - 1) {
+        D("draining the inbox did not free the cancelled coroutine");
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+struct spawn_args_args {
+    char text[40];
+    char copy[40];
+};
+
+static void spawn_args_start(void *arguments)
+{
+    struct spawn_args_args *args = arguments;
+    struct spawn_args_args **out = (void *)green_await_sp((green_await_t)args);
+    strcpy(args->copy, args->text);
+    **out = *args;
+}
+
+DEFTEST(test_spawn_args)
+{
+    struct spawn_args_args *args, result, *out = &result;
+    green_thread_t co = green_spawn_sp(spawn_args_start, NULL, 0);
+    char *handle = (char *)co;
+
+    args = green_spawn_args(co, sizeof(*args));
+    if (args == NULL) {
+        D("green_spawn_args failed: %s", strerror(errno));
+        return FAIL;
+    }
+
+    if ((char *)args > handle || (char *)args < handle - 1024
+        || (uintptr_t)args % 16 != 0) {
+        D("arguments at %p are not aligned near the top of stack %p",
+          (void *)args, (void *)co);
+        return FAIL;
+    }
+
+    strcpy(args->text, "kept on the coroutine's stack");
+    if ((void *)green_resume_sp(co, NULL) != args) {
+        D("start was not given the reserved space");
+        return FAIL;
+    }
+
+    if (green_spawn_args(co, 16) != NULL || errno != EALREADY) {
+        D("reserving after starting did not fail with EALREADY");
+        return FAIL;
+    }
+
+    if (green_resume_sp(co, (green_resume_t)&out) != NULL
+        || strcmp(result.copy, "kept on the coroutine's stack") != 0) {
+        D("coroutine did not see its arguments");
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+static void stack_classes_start(void *arguments)
+{
+    int *key = arguments;
+    if (green_local_get(*key) != NULL)
+        *key = -1;
+    green_local_set(*key, arguments);
+}
+
+// Use most of a 64K stack, which would run into its guard page
+// if the guard were taken out of what was asked for
+static void stack_deep_start(void *arguments)
+{
+    volatile char frame[60000];
+    memset((char *)frame, 1, sizeof(frame));
+    *(int *)arguments = frame[0] + frame[sizeof(frame) - 1];
+}
+
+DEFTEST(test_stack_classes)
+{
+    struct green_stack_stats before[GREEN_STACK_CLASSES], after[GREEN_STACK_CLASSES];
+    green_thread_t co[2], big;
+    int key = green_local_key();
+
+    if (green_stack_stats(before, GREEN_STACK_CLASSES) != GREEN_STACK_CLASSES
+        || before[0].size != GREEN_STACK_MIN
+        || before[GREEN_STACK_CLASSES - 1].size != GREEN_STACK_MAX) {
+        D("size classes do not run from GREEN_STACK_MIN to GREEN_STACK_MAX");
+        return FAIL;
+    }
+
+    // 3000 and 8192 round up to the 4K and 8K classes
+    co[0] = green_spawn_sp(stack_classes_start, &key, 3000);
+    co[1] = green_spawn_sp(stack_classes_start, &key, 8192);
+    big = green_spawn_sp(stack_classes_start, &key, 2 * GREEN_STACK_MAX);
+    green_stack_stats(after, GREEN_STACK_CLASSES);
+    if (after[0].in_use != before[0].in_use + 1
+        || after[1].in_use != before[1].in_use + 1
+        || after[0].allocs != before[0].allocs + 1) {
+        D("4K and 8K classes show %zu and %zu in use (expect %zu and %zu)",
+          after[0].in_use, after[1].in_use,
+          before[0].in_use + 1, before[1].in_use + 1);
+        return FAIL;
+    }
+
+    green_resume_sp(co[0], NULL);
+    green_resume_sp(co[1], NULL);
+    green_resume_sp(big, NULL);
+    green_stack_stats(after, GREEN_STACK_CLASSES);
+    if (after[0].in_use != before[0].in_use || after[1].in_use != before[1].in_use) {
+        D("finished stacks were not returned to their classes");
+        return FAIL;
+    }
+
+    // The freed 4K stack is the first free one again,
+    // and must not remember the last coroutine's locals
+    if (green_spawn_sp(stack_classes_start, &key, 4096) != co[0]) {
+        D("freed stack was not reused");
+        return FAIL;
+    }
+    green_resume_sp(co[0], NULL);
+    if (key == -1) {
+        D("reused stack kept the last coroutine's locals");
+        return FAIL;
+    }
+
+    // A guarded stack still has all the room that was asked for
+    int deep = 0;
+    green_stack_stats(before, GREEN_STACK_CLASSES);
+    co[0] = green_spawn_sp(stack_deep_start, &deep, 0x10000);
+    green_stack_stats(after, GREEN_STACK_CLASSES);
+    if (after[5].in_use != before[5].in_use + 1) {
+        D("64K with a guard page did not round up to the 128K class");
+        return FAIL;
+    }
+    green_resume_sp(co[0], NULL);
+    if (deep != 2) {
+        D("deep coroutine did not finish");
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+static void mem_limit_start(void *arguments)
+{
+    (void)arguments;
+}
+
+DEFTEST(test_mem_limit)
+{
+    struct green_mem_stats before, self, during, after;
+    green_thread_t co[2];
+
+    green_mem_stats(&before);
+    green_mem_stats_self(&self);
+    co[0] = green_spawn_sp(mem_limit_start, NULL, 8192);
+    green_mem_stats(&during);
+    if (during.live != before.live + 1
+        || during.committed != before.committed + 8192
+        || during.reserved < during.committed) {
+        D("live %zu committed %zu reserved %zu after spawning one 8K stack",
+          during.live, during.committed, during.reserved);
+        return FAIL;
+    }
+    green_mem_stats_self(&after);
+    if (after.live != self.live + 1 || after.committed != self.committed + 8192) {
+        D("this pthread was not charged for its spawn");
+        return FAIL;
+    }
+
+    // Room for exactly one more live coroutine
+    green_mem_limit(during.live + 1, 0);
+    co[1] = green_spawn_sp(mem_limit_start, NULL, 8192);
+    if (co[1] == NULL || green_spawn_sp(mem_limit_start, NULL, 8192) != NULL
+        || errno != EAGAIN) {
+        D("live limit did not refuse the third spawn with EAGAIN");
+        green_mem_limit(0, 0);
+        return FAIL;
+    }
+    green_resume_sp(co[1], NULL);
+
+    // And no room for another 8K of stack
+    green_mem_limit(0, during.committed + 4096);
+    if (green_spawn_sp(mem_limit_start, NULL, 8192) != NULL || errno != EAGAIN) {
+        D("committed limit did not refuse an 8K spawn with EAGAIN");
+        green_mem_limit(0, 0);
+        return FAIL;
+    }
+    co[1] = green_spawn_sp(mem_limit_start, NULL, 4096);
+    green_mem_limit(0, 0);
+    if (co[1] == NULL) {
+        D("committed limit refused a 4K spawn that fits");
+        return FAIL;
+    }
+    green_resume_sp(co[1], NULL);
+
+    green_resume_sp(co[0], NULL);
+    green_mem_stats(&after);
+    if (after.live != before.live || after.committed != before.committed) {
+        D("live %zu committed %zu after release (expect %zu and %zu)",
+          after.live, after.committed, before.live, before.committed);
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+struct watchdog_seen {
+    int reports;
+    int attached;
+    struct green_stall stall;
+};
+
+// Static, since the pthread may outlive a report that gave up on it
+static int watchdog_attached;
+
+static void *watchdog_attach_start(void *arguments)
+{
+    (void)arguments;
+    if (green_watchdog_attach(NULL) == 0) {
+        green_watchdog_detach();
+        __atomic_store_n(&watchdog_attached, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void watchdog_report(const struct green_stall *stall, void *context)
+{
+    struct watchdog_seen *seen = context;
+    struct timespec pause = { 0, 1000000 };
+    pthread_t pthread;
+
+    seen->stall = *stall;
+
+    // Other pthreads can still attach while a report is being made
+    __atomic_store_n(&watchdog_attached, 0, __ATOMIC_RELAXED);
+    if (pthread_create(&pthread, NULL, watchdog_attach_start, NULL) == 0) {
+        for (int i = 0; i < 1000; i += 1) {
+            if ((seen->attached = __atomic_load_n(&watchdog_attached, __ATOMIC_ACQUIRE)))
+                break;
+            nanosleep(&pause, NULL);
+        }
+        if (seen->attached)
+            pthread_join(pthread, NULL);
+        else
+            pthread_detach(pthread);
+    }
+
+    __atomic_add_fetch(&seen->reports, 1, __ATOMIC_RELEASE);
+}
+
+static void watchdog_run_for(unsigned long ms, int switching)
+{
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        if (switching)
+            green_await_sp((green_await_t)&start);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000
+             + (now.tv_nsec - start.tv_nsec) / 1000000 < (long)ms);
+}
+
+static void watchdog_spin_start(void *arguments)
+{
+    (void)arguments;
+    watchdog_run_for(150, 0);
+}
+
+static void watchdog_yield_start(void *arguments)
+{
+    (void)arguments;
+    watchdog_run_for(150, 1);
+}
+
+// A resume that fails is not progress, so it must not count as a switch
+static void watchdog_bad_resume_start(void *arguments)
+{
+    int *counted = arguments;
+    unsigned long switches = _green_switches;
+
+    if (green_resume_sp(*_green_current(), NULL) == GREEN_RESUME_FAILED)
+        *counted = _green_switches != switches;
+}
+
+DEFTEST(test_watchdog)
+{
+    struct watchdog_seen seen = { 0 };
+    int marker;
+    green_thread_t co;
+    stack_t altstack;
+    char *sp;
+
+    if (green_watchdog_attach(&marker) != 0
+        || green_watchdog_start(20000, watchdog_report, &seen) != 0) {
+        D("could not start the watchdog: %s", strerror(errno));
+        green_watchdog_detach();
+        return FAIL;
+    }
+
+    // Samples land on whatever coroutine is running; they need their own stack
+    if (sigaltstack(NULL, &altstack) != 0 || (altstack.ss_flags & SS_DISABLE)) {
+        D("attaching did not set up an alternate signal stack");
+        goto fail;
+    }
+
+    int counted = -1;
+    co = green_spawn_sp(watchdog_bad_resume_start, &counted, 0);
+    green_resume_sp(co, NULL);
+    if (counted != 0) {
+        D("a failed resume was counted as a switch (%d)", counted);
+        goto fail;
+    }
+
+    // Switching often enough is fine, however long it goes on
+    co = green_spawn_sp(watchdog_yield_start, NULL, 16384);
+    while (green_resume_sp(co, NULL) != NULL) {}
+    if (__atomic_load_n(&seen.reports, __ATOMIC_ACQUIRE) != 0) {
+        D("a coroutine that kept switching was reported");
+        goto fail;
+    }
+
+    co = green_spawn_sp(watchdog_spin_start, NULL, 16384);
+    green_resume_sp(co, NULL);
+    green_watchdog_stop();
+    green_watchdog_detach();
+
+    sp = seen.stall.sp;
+    if (sigaltstack(NULL, &altstack) != 0 || !(altstack.ss_flags & SS_DISABLE)) {
+        D("alternate signal stack outlived the attachment");
+        return FAIL;
+    } else if (seen.reports != 1) {
+        D("stalled coroutine was reported %d times", seen.reports);
+        return FAIL;
+    } else if (!seen.attached) {
+        D("attaching another pthread waited for the report");
+        return FAIL;
+    }
+    if (seen.stall.thread != co || seen.stall.start != watchdog_spin_start
+        || seen.stall.worker != &marker || seen.stall.stalled_us < 20000) {
+        D("report was for %p (start %p) after %lu us",
+          (void *)seen.stall.thread, (void *)seen.stall.start, seen.stall.stalled_us);
+        return FAIL;
+    }
+    if (sp == NULL || sp >= (char *)co || sp < (char *)co - 16384) {
+        D("reported stack pointer %p is not on the coroutine's stack", (void *)sp);
+        return FAIL;
+    }
+
+    return PASS;
+
+fail:
+    green_watchdog_stop();
+    green_watchdog_detach();
+    return FAIL;
+}
+
+
+#define CONTEND_PTHREADS    4
+#define CONTEND_COROUTINES  3
+#define CONTEND_MS          200
+
+struct contend_co {
+    green_thread_t thread;
+    int inside;
+    unsigned long count;    // deliberately not atomic
+    unsigned long bad;
+    int stop;
+};
+
+struct contend_pthread {
+    pthread_t pthread;
+    struct contend_co *cos;
+    int use_inline;
+    unsigned long handoffs;
+    unsigned long lost;
+    unsigned long misrouted;
+};
+
+static void contend_start(void *arguments)
+{
+    struct contend_co *co = arguments;
+    green_resume_t token = (green_resume_t)co;  // the first resume's value is not seen
+
+    for (;;) {
+        if (__atomic_add_fetch(&co->inside, 1, __ATOMIC_RELAXED) != 1
+            || green_self() != co->thread)
+            __atomic_add_fetch(&co->bad, 1, __ATOMIC_RELAXED);
+        co->count += 1;
+        __atomic_sub_fetch(&co->inside, 1, __ATOMIC_RELAXED);
+
+        if (co->stop)
+            return;
+        token = green_await((green_await_t)token);
+    }
+}
+
+static void *contend_run(void *arguments)
+{
+    struct contend_pthread *self = arguments;
+    struct timespec start, now;
+    struct contend_co *co;
+    green_await_t got;
+    unsigned long i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0;; i += 1) {
+        if (i % 1024 == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - start.tv_sec) * 1000
+                + (now.tv_nsec - start.tv_nsec) / 1000000 >= CONTEND_MS)
+                break;
+        }
+
+        co = &self->cos[i % CONTEND_COROUTINES];
+        if (self->use_inline)
+            got = green_resume_inline(co->thread, (green_resume_t)self);
+        else
+            got = green_resume(co->thread, (green_resume_t)self);
+
+        if (got == GREEN_RESUME_FAILED) {
+            self->lost += 1;
+            continue;
+        }
+
+        self->handoffs += 1;
+        if (got != (green_await_t)self && got != (green_await_t)co)
+            self->misrouted += 1;
+    }
+
+    return NULL;
+}
+
+DEFTEST(test_resume_contention)
+{
+    struct contend_co cos[CONTEND_COROUTINES] = { { 0 } };
+    struct contend_pthread pthreads[CONTEND_PTHREADS] = { { 0 } };
+    unsigned long handoffs = 0, lost = 0, misrouted = 0, counted = 0, bad = 0;
+    int i, started, unfinished = 0;
+
+    for (i = 0; i < CONTEND_COROUTINES; i += 1)
+        cos[i].thread = green_spawn(contend_start, &cos[i], 0);
+
+    // Half the pthreads go through green_inline.h's activation instead
+    for (started = 0; started < CONTEND_PTHREADS; started += 1) {
+        pthreads[started].cos = cos;
+        pthreads[started].use_inline = started % 2;
+        if (pthread_create(&pthreads[started].pthread, NULL,
+                           contend_run, &pthreads[started]) != 0)
+            break;
+    }
+    for (i = 0; i < started; i += 1) {
+        pthread_join(pthreads[i].pthread, NULL);
+        handoffs += pthreads[i].handoffs;
+        lost += pthreads[i].lost;
+        misrouted += pthreads[i].misrouted;
+    }
+
+    for (i = 0; i < CONTEND_COROUTINES; i += 1) {
+        cos[i].stop = 1;
+        if (green_resume(cos[i].thread, NULL) != NULL)
+            unfinished += 1;
+        counted += cos[i].count;
+        bad += cos[i].bad;
+    }
+
+    if (started < 2) {
+        D("could only start %d pthreads", started);
+        return FAIL;
+    }
+
+    D("%lu handoffs/s across %d pthreads (%lu lost races)",
+      handoffs * 1000 / CONTEND_MS, started, lost);
+    if (unfinished != 0) {
+        D("%d coroutines did not finish when stopped", unfinished);
+        return FAIL;
+    }
+    if (bad != 0 || misrouted != 0) {
+        D("%lu resumes shared a coroutine, %lu returned to the wrong pthread",
+          bad, misrouted);
+        return FAIL;
+    }
+    if (counted != handoffs + CONTEND_COROUTINES) {
+        D("coroutines counted %lu resumes (expect %lu); some updates were lost",
+          counted, handoffs + CONTEND_COROUTINES);
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+static void deferred_start(void *arguments)
+{
+    int *runs = arguments;
+    *runs += 1;
+    green_await((green_await_t)runs);
+}
+
+static void deferred_reenter_start(void *arguments)
+{
+    struct green_deferred *deferred = arguments;
+
+    // Whoever is resuming it owns it, including the coroutine itself
+    if (green_deferred_resume(deferred, NULL) == GREEN_RESUME_FAILED && errno == EBUSY
+        && green_deferred_cancel(deferred) != 0 && errno == EBUSY)
+        deferred->arguments = NULL;
+}
+
+DEFTEST(test_deferred)
+{
+    struct green_deferred deferred, dropped;
+    struct green_mem_stats before, after;
+    int runs = 0, dropped_runs = 0;
+
+    green_mem_stats(&before);
+    green_spawn_deferred(&deferred, deferred_start, &runs, 0);
+    green_spawn_deferred(&dropped, deferred_start, &dropped_runs, 0);
+    green_mem_stats(&after);
+    if (after.live != before.live || deferred.thread != NULL) {
+        D("deferring a spawn allocated a stack");
+        return FAIL;
+    }
+
+    // Never resumed, so there is nothing to free
+    if (green_deferred_cancel(&dropped) != 0
+        || green_deferred_resume(&dropped, NULL) != GREEN_RESUME_FAILED
+        || errno != ESRCH || dropped_runs != 0) {
+        D("cancelled deferred coroutine could still be resumed");
+        return FAIL;
+    }
+
+    if (green_deferred_resume(&deferred, NULL) != (green_await_t)&runs
+        || runs != 1 || deferred.thread == NULL) {
+        D("first resume did not spawn and run the coroutine");
+        return FAIL;
+    }
+    green_mem_stats(&after);
+    if (after.live != before.live + 1) {
+        D("first resume did not allocate a stack");
+        return FAIL;
+    }
+
+    if (green_deferred_resume(&deferred, NULL) != NULL) {
+        D("second resume did not finish the coroutine");
+        return FAIL;
+    }
+    green_mem_stats(&after);
+    if (after.live != before.live || deferred.thread != NULL
+        || green_deferred_resume(&deferred, NULL) != GREEN_RESUME_FAILED
+        || errno != ESRCH) {
+        D("finished deferred coroutine was not released for good");
+        return FAIL;
+    }
+
+    // Cancelling one that has started frees its stack
+    green_spawn_deferred(&deferred, deferred_start, &runs, 0);
+    green_deferred_resume(&deferred, NULL);
+    if (green_deferred_cancel(&deferred) != 0) {
+        D("could not cancel a started deferred coroutine");
+        return FAIL;
+    }
+    green_mem_stats(&after);
+    if (after.live != before.live) {
+        D("cancelling a started deferred coroutine leaked its stack");
+        return FAIL;
+    } else if (green_deferred_cancel(&deferred) != 0) {
+        D("cancelling a cancelled deferred coroutine failed");
+        return FAIL;
+    }
+
+    green_spawn_deferred(&deferred, deferred_reenter_start, &deferred, 0);
+    if (green_deferred_resume(&deferred, NULL) != NULL || deferred.arguments != NULL) {
+        D("a deferred coroutine could be resumed while it was running");
+        return FAIL;
+    }
+
+    return PASS;
+}
+
+
+// Defined in test-green-hpp.cpp
+const char *test_hpp_spawn();
+const char *test_hpp_join();
+const char *test_hpp_wait_direct();
+
+DEFTEST(test_hpp)
+{
+    const char *(*const parts[])() = {
+        test_hpp_spawn,
+        test_hpp_join,
+        test_hpp_wait_direct,
+    };
+    const char *why;
+
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i += 1) {
+        if ((why = parts[i]()) != NULL) {
+            D("%s", why);
+            return FAIL;
+        }
+    }
+
+    return PASS;
+}
+
+
+#if defined(__x86_64__)
+    asm(
+        "   .text                   \n"
+
+        ".macro _sprot              \n"
+#ifdef _GREEN_EXPORT_INTERNALS
+        "   call    _green_current  \n"
+        "   movq    (%rax), %rax    \n"
+        "   cmpq    $0, %rax        \n"
+        "   jne     1f              \n"
+        "   call    _root_stack     \n"
+        "   movq    _root_stack_size(%rip), %rcx    \n"
+        "   jmp     2f              \n"
+        "1:                         \n"
+        "   movq    -40(%rax), %rcx \n"
+        "2:                         \n"
+        "   cmpq    %rax, %rsp      \n"
+        "   jge     2f              \n"
+        "   subq    %rcx, %rax      \n"
+        "   cmpq    %rax, %rsp      \n"
+        "   jge     1f              \n"
+        "   addq    %rcx, %rax      \n"
+        "2:                         \n"
+        "   movq    %rsp, %rdi      \n"
+        "   movq    %rax, %rsi      \n"
+        "   call    _BAIL_ACTV      \n"
+        "1:                         \n"
+#endif
+        "   pushq   %rbp            \n"
+        "   pushq   %rbx            \n"
+        "   pushq   %r12            \n"
+        "   pushq   %r13            \n"
+        "   pushq   %r14            \n"
+        "   pushq   %r15            \n"
+        "   movq    $32, %rcx       \n"
+        "1:                         \n"
+        "   pushq   %rbp            \n"
+        "   loop    1b              \n"
+        ".endm                      \n"
+
+        ".macro _stest              \n"
+        "   movq    $32, %rcx       \n"
+        "1:                         \n"
+        "   popq    %rdx            \n"
+        "   cmpq    %rdx, %rbp      \n"
+        "   loope   1b              \n"
+        "   je      1f              \n"
+        "   movq    %rsp, %rdi      \n"
+        "   addq    $32, %rdi       \n"
+        "   subq    %rcx, %rdi      \n"
+        "   movq    %rcx, %rsi      \n"
+        "   movq    %rbp, %rcx      \n"
+        "   call    _BAIL_BUFR      \n"
+        "1:                         \n"
+        "   movq    $6, %rsi        \n"
+        "   popq    %rdx            \n"
+        "   subq    $1, %rsi        \n"
+        "   movq    %r15, %rcx      \n"
+        "   cmpq    %rdx, %rcx      \n"
+        "   jne     2f              \n"
+        "   popq    %rdx            \n"
+        "   subq    $1, %rsi        \n"
+        "   movq    %r14, %rcx      \n"
+        "   cmpq    %rdx, %rcx      \n"
+        "   jne     2f              \n"
+        "   popq    %rdx            \n"
+        "   subq    $1, %rsi        \n"
+        "   movq    %r13, %rcx      \n"
+        "   cmpq    %rdx, %rcx      \n"
+        "   jne     2f              \n"
+        "   popq    %rdx            \n"
+        "   subq    $1, %rsi        \n"
+        "   movq    %r12, %rcx      \n"
+        "   cmpq    %rdx, %rcx      \n"
+        "   jne     2f              \n"
+        "   popq    %rdx            \n"
+        "   subq    $1, %rsi        \n"
+        "   movq    %rbx, %rcx      \n"
+        "   cmpq    %rdx, %rcx      \n"
+        "   jne     2f              \n"
+        "   popq    %rdx            \n"
+        "   subq    $1, %rsi        \n"
+        "   movq    %rbp, %rcx      \n"
+        "   cmpq    %rdx, %rcx      \n"
+        "   je      1f              \n"
+        "2:                         \n"
+        "   movq    %rsp, %rdi      \n"
+        "   addq    $6, %rdi        \n"
+        "   subq    %rdx, %rdi      \n"
+        "   call    _BAIL_STOR      \n"
+        "1:                         \n"
+        ".endm                      \n"
+
+        "_test_green__spawn_sp:     \n"
+        "   pushq   %r12            \n"
+        "   pushq   %r13            \n"
+        "   pushq   %r14            \n"
+        "   pushq   %r15            \n"
+        "   leaq    _test_green__spawn_sp(%rip), %r15   \n"
+        "   movq    %rdi, %r14      \n"
+        "   movq    %rsi, %r13      \n"
+        "   movq    %rdx, %r12      \n"
+        "   _sprot                  \n"
+        "   call    green_spawn     \n"
+        "   _stest                  \n"
+        "   popq    %r15            \n"
+        "   popq    %r14            \n"
+        "   popq    %r13            \n"
+        "   popq    %r12            \n"
+        "   ret                     \n"
+
+        "_test_green__await_sp:     \n"
+        "   pushq   %r14            \n"
+        "   pushq   %r15            \n"
+        "   leaq    _test_green__await_sp(%rip), %r15   \n"
+        "   movq    %rdi, %r14      \n"
+        "   _sprot                  \n"
+        "   call    green_await     \n"
+        "   _stest                  \n"
+        "   popq    %r15            \n"
+        "   popq    %r14            \n"
+        "   ret                     \n"
+
+        "_test_green__resume_sp:    \n"
+        "   pushq   %r13            \n"
+        "   pushq   %r14            \n"
+        "   pushq   %r15            \n"
+        "   leaq    _test_green__resume_sp(%rip), %r15  \n"
+        "   movq    %rdi, %r14      \n"
+        "   movq    %rsi, %r13      \n"
+        "   _sprot                  \n"
+        "   call    green_resume    \n"
+        "   _stest                  \n"
+        "   popq    %r15            \n"
+        "   popq    %r14            \n"
+        "   popq    %r13            \n"
+        "   ret                     \n"
+    );
+
+#elif defined(__aarch64__)
+    asm(
+        "   .text                           \n"
+
+        ".macro _sprot                      \n"
+#ifdef _GREEN_EXPORT_INTERNALS
+        "   bl      _green_current          \n"
+        "   ldr     x0, [x0]                \n"
+        "   cmp     x0, #0                  \n"
+        "   bne     1f                      \n"
+        "   bl      _root_stack             \n"
+        "   ldr     x1, _root_stack_size    \n"
+        "   b       2f                      \n"
+        "1:                                 \n"
+        "   ldr     x1, [x0, #8]            \n"
+        "2:                                 \n"
+        "   cmp     sp, x0                  \n"
+        "   bge     2f                      \n"
+        "   sub     x0, x0, x1              \n"
+        "   cmp     sp, x0                  \n"
+        "   bge     1f                      \n"
+        "   add     x0, x0, x1              \n"
+        "2:                                 \n"
+        "   mov     x0, x1                  \n"
+        "   mov     sp, x0                  \n"
+        "   bl      _BAIL_ACTV              \n"
+        "1:                                 \n"
+#endif
+        "   mov     x6, sp                  \n"
+        "   stp     x29, x6, [sp, #-16]!    \n"
+        "   stp     x27, x28, [sp, #-16]!   \n"
+        "   stp     x25, x26, [sp, #-16]!   \n"
+        "   stp     x23, x24, [sp, #-16]!   \n"
+        "   stp     x21, x22, [sp, #-16]!   \n"
+        "   stp     x19, x20, [sp, #-16]!   \n"
+        "   sub     x1, sp, #(32*8)         \n"
+        "1:                                 \n"
+        "   stp     x29, x29, [sp, #-16]!   \n"
+        "   cmp     sp, x1                  \n"
+        "   bne     1b                      \n"
+        ".endm                              \n"
+
+        ".macro _stest                      \n"
+        "   mov     x6, sp                  \n"
+        "   mov     x1, #31                 \n"
+        "   mov     x3, x29                 \n"
+        "1:                                 \n"
+        "   ldr     x2, [x6, x1, lsl #3]    \n"
+        "   cmp     x2, x3                  \n"
+        "   bne     2f                      \n"
+        "   subs    x1, x1, #1              \n"
+        "   bpl     1b                      \n"
+        "   add     x6, x6, #(32*8)         \n"
+        "   b       1f                      \n"
+        "2:                                 \n"
+        "   mov     x0, x6                  \n"
+        "   mov     x5, #31                 \n"
+        "   sub     x1, x5, x1              \n"
+        "   mov     x3, x29                 \n"
+        "   bl      _BAIL_BUFR              \n"
+        "1:                                 \n"
+        "   ldr     x2, [x6], #8            \n"
+        "   cmp     x2, x19                 \n"
+        "   csel    x3, x19, x3, ne         \n"
+        "   bne     2f                      \n"
+        "   ldr     x2, [x6], #8            \n"
+        "   cmp     x2, x20                 \n"
+        "   csel    x3, x20, x3, ne         \n"
+        "   bne     2f                      \n"
+        "   ldr     x2, [x6], #8            \n"
+        "   cmp     x2, x21                 \n"
+        "   csel    x3, x21, x3, ne         \n"
+        "   bne     2f                      \n"
+        "   ldr     x2, [x6], #8            \n"
+        "   cmp     x2, x22                 \n"
+        "   csel    x3, x22, x3, ne         \n"
+        "   bne     2f                      \n"
+        "   ldr     x2, [x6], #8            \n"
+        "   cmp     x2, x23                 \n"
+        "   csel    x3, x23, x3, ne         \n"
+        "   bne     2f                      \n"
+        "   ldr     x2, [x6], #8            \n"
+        "   cmp     x2, x24                 \n"
+        "   csel    x3, x24, x3, ne         \n"
+        "   bne     2f                      \n"
+        "   ldr     x2, [x6], #8            \n"
+        "   cmp     x2, x25                 \n"
+        "   csel    x3, x25, x3, ne         \n"
+        "   bne     2f                      \n"
+        "   ldr     x2, [x6], #8            \n"
+        "   cmp     x2, x26                 \n"
+        "   csel    x3, x26, x3, ne         \n"
+        "   bne     2f                      \n"
+        "   ldr     x2, [x6], #8            \n"
+        "   cmp     x2, x27                 \n"
+        "   csel    x3, x27, x3, ne         \n"
         "   bne     2f                      \n"
         "   ldr     x2, [x6], #8            \n"
         "   cmp     x2, x28                 \n"
@@ -969,3 +3405,4 @@ DEFTEST(test_bad_await)
     );
 
 #endif
+